@@ -0,0 +1,93 @@
+<?hh
+// Compares BaseLayoutHelper::render (one pass, markers) with the previous
+// approach of rendering the layout once to collect resources and again to
+// output it, on a tree of nested widgets. Run from the application root:
+//
+//   hhvm vendor/base/base/bench/layout_render.hh [depth] [width] [iterations]
+require_once 'vendor/autoload.php';
+
+class :bench:layout extends :base:layout {
+  protected array<string, :x:frag> $sections = [];
+
+  public function init() {
+    $this->sections = [
+      'stylesheets' => <x:frag />,
+      'body' => <x:frag />,
+      'javascripts' => <x:frag />,
+    ];
+  }
+
+  public function render(): :x:element {
+    return
+      <x:doctype>
+        <html>
+          <head>{$this->sections['stylesheets']}</head>
+          <body>
+            {$this->sections['body']}
+            {$this->sections['javascripts']}
+          </body>
+        </html>
+      </x:doctype>;
+  }
+}
+
+class :bench:widget extends :base:widget {
+  attribute
+    int depth = 0,
+    int width = 1;
+
+  protected function renderCached(): ?XHPRoot {
+    $depth = $this->getAttribute('depth');
+    $width = $this->getAttribute('width');
+    $this->css('/css/bench' . ($depth % 10) . '.css');
+    $this->js('/js/bench' . ($depth % 10) . '.js');
+
+    $node = <div />;
+    if ($depth > 0) {
+      for ($i = 0; $i < $width; $i++) {
+        $node->appendChild(
+          <bench:widget depth={$depth - 1} width={$width} />);
+      }
+    }
+    return $node;
+  }
+}
+
+function bench_layout(int $depth, int $width): :bench:layout {
+  $layout = <bench:layout />;
+  $layout->section('body')->appendChild(
+    <bench:widget depth={$depth} width={$width} />);
+  return $layout;
+}
+
+function bench_double_pass(int $depth, int $width): string {
+  $layout = bench_layout($depth, $width);
+  $layout->__toString();
+  foreach (BaseLayoutHelper::resources($layout) as $section => $elements) {
+    foreach ($elements as $element) {
+      $layout->section($section)->appendChild($element);
+    }
+  }
+  return (string)$layout;
+}
+
+function bench_single_pass(int $depth, int $width): string {
+  return BaseLayoutHelper::render(bench_layout($depth, $width));
+}
+
+$depth = (int)idx($argv, 1, 6);
+$width = (int)idx($argv, 2, 3);
+$iterations = (int)idx($argv, 3, 20);
+
+foreach (['bench_double_pass', 'bench_single_pass'] as $function) {
+  $function($depth, $width);
+  $t = microtime(true);
+  for ($i = 0; $i < $iterations; $i++) {
+    $html = $function($depth, $width);
+  }
+  printf(
+    "%-18s %8.2fms/render  %d bytes\n",
+    $function,
+    (microtime(true) - $t) * 1000 / $iterations,
+    strlen($html));
+}
@@ -0,0 +1,72 @@
+<?hh
+// Compares TemplateEngine, with and without singlePass(), against reading
+// the template and calling str_replace for every render, as TemplateEngine
+// used to. Runs in a temporary directory holding a generated template:
+//
+//   hhvm vendor/base/base/bench/template_engine.hh [vars] [size] [iterations]
+require_once 'vendor/autoload.php';
+
+function bench_vars(int $count): array<string, string> {
+  $vars = [];
+  for ($i = 0; $i < $count; $i++) {
+    $vars['{{var' . $i . '}}'] = str_repeat('v', $i % 20);
+  }
+  return $vars;
+}
+
+function bench_str_replace(array<string, string> $vars): string {
+  return str_replace(
+    array_keys($vars),
+    array_values($vars),
+    file_get_contents('templates/bench.html'));
+}
+
+function bench_engine(array<string, string> $vars): string {
+  $engine = new TemplateEngine('bench.html');
+  foreach ($vars as $key => $value) {
+    $engine->setVar($key, $value);
+  }
+  return (string)$engine->layout();
+}
+
+function bench_engine_single_pass(array<string, string> $vars): string {
+  $engine = (new TemplateEngine('bench.html'))->singlePass();
+  foreach ($vars as $key => $value) {
+    $engine->setVar($key, $value);
+  }
+  return (string)$engine->layout();
+}
+
+$count = (int)idx($argv, 1, 50);
+$size = (int)idx($argv, 2, 20000);
+$iterations = (int)idx($argv, 3, 1000);
+
+$dir = sys_get_temp_dir() . '/base_bench_' . getmypid();
+mkdir($dir . '/templates', 0777, true);
+$template = '';
+while (strlen($template) < $size) {
+  $template .= '<p>' . str_repeat('text ', 10) . '{{var' .
+    (strlen($template) % $count) . '}}</p>';
+}
+file_put_contents($dir . '/templates/bench.html', $template);
+chdir($dir);
+
+$vars = bench_vars($count);
+$functions =
+  ['bench_str_replace', 'bench_engine', 'bench_engine_single_pass'];
+foreach ($functions as $function) {
+  $function($vars);
+  $t = microtime(true);
+  for ($i = 0; $i < $iterations; $i++) {
+    $output = $function($vars);
+  }
+  printf(
+    "%-26s %8.3fms/render  %d bytes\n",
+    $function,
+    (microtime(true) - $t) * 1000 / $iterations,
+    strlen($output));
+}
+
+unlink($dir . '/templates/bench.html');
+rmdir($dir . '/templates');
+rmdir($dir);
@@ -6,7 +6,8 @@ class BaseController {
     $restricted,
     $path,
     $skipParamValidation,
-    $jsonForced;
+    $jsonForced,
+    $streamingLayout;
 
   public final function __construct(
     $route = null,
@@ -14,12 +15,14 @@ class BaseController {
     $files = [],
     $can_access_restricted_endpoints = false) {
     $this->restricted = false;
+    $this->streamingLayout = null;
     $this->params = [];
     $this->path = $route;
 
     $this->skipParamValidation = false;
 
     try {
+      $t = BaseProfiler::start();
       $params = $this->params();
       if (true === $this->skipParamValidation) {
         $this->params = array_merge($_GET, $_POST, $_FILES);
@@ -30,11 +33,36 @@ class BaseController {
       } else {
         throw new RuntimeException('Invalid params supplied.');
       }
+      BaseProfiler::stop('params', $t);
 
+      $t = BaseProfiler::start();
       $this->init();
-      $this->genFlow();
+      BaseProfiler::stop('init', $t);
+
+      $this->streamHead();
+
+      // Headers cannot be sent anymore once the head has been streamed.
+      if ($this->streamingLayout !== null) {
+        set_error_handler([$this, 'lateHeader'], E_WARNING);
+      }
+      try {
+        $t = BaseProfiler::start();
+        $this->genFlow();
+        BaseProfiler::stop('genFlow', $t);
+      } finally {
+        if ($this->streamingLayout !== null) {
+          restore_error_handler();
+        }
+      }
+
       $this->success = true;
+      if ($this->notModified()) {
+        return $this;
+      }
+
+      $t = BaseProfiler::start();
       $this->out();
+      BaseProfiler::stop('out', $t);
 
     } catch (Exception $e) {
       $this->success = false;
@@ -49,6 +77,29 @@ class BaseController {
     return [];
   }
 
+  // GET controllers that serve the same page to every anonymous visitor
+  // can opt into the page cache by returning a TTL in seconds. The page is
+  // keyed by route, path, locale and the request params listed in
+  // pageCacheVary(); after the TTL, it is still served for
+  // pageCacheStale() seconds while it is regenerated in the background.
+  public static function pageCacheTTL(): int {
+    return 0;
+  }
+
+  public static function pageCacheStale(): int {
+    return 0;
+  }
+
+  public static function pageCacheVary(): array<string> {
+    return [];
+  }
+
+  // gzip/brotli level used when RESPONSE_COMPRESSION is enabled, 0 to
+  // leave this route's responses uncompressed.
+  public static function compressionLevel(): int {
+    return BaseConfig::getInt('RESPONSE_COMPRESSION_LEVEL') ?: 6;
+  }
+
   protected function skipParamValidation() {$this->skipParamValidation = true;}
 
   // Controllers can override this and use it as a constructor.
@@ -61,6 +112,95 @@ class BaseController {
   // exception message.
   protected function genFlow() {return [];}
 
+  // Controllers can return their layout here to have its <head> flushed to
+  // the browser right after init(), so that stylesheets and scripts load
+  // while genFlow() runs. The layout must implement renderHead() and
+  // renderBody(), and render() should fill and return the same instance,
+  // available through streamingLayout().
+  protected function createStreamingLayout(): ?:base:layout {
+    return null;
+  }
+
+  // Controllers can derive validators from the data loaded in genFlow().
+  // When the client already has the current version, a 304 is sent and
+  // neither render() nor renderJSON() is called.
+  protected function etag(): ?string {
+    return null;
+  }
+
+  protected function lastModified(): ?int {
+    return null;
+  }
+
+  private function notModified(): bool {
+    if ($this instanceof BaseListener || $this->streamingLayout !== null) {
+      return false;
+    }
+
+    $etag = $this->etag();
+    $last_modified = $this->lastModified();
+    if ($etag === null && $last_modified === null) {
+      return false;
+    }
+
+    return BaseView::notModified($etag, $last_modified);
+  }
+
+  final public function lateHeader(
+    int $errno,
+    string $message,
+    ?string $file = null,
+    ?int $line = null): bool {
+    if (strpos($message, 'headers already sent') === false) {
+      return false;
+    }
+
+    logger(
+      sprintf(
+        '%s set a header or redirected after its layout head was streamed',
+        get_class($this)) . PHP_EOL,
+      $file,
+      $line,
+      BaseLogger::WARNING);
+    return true;
+  }
+
+  protected final function streamingLayout(): ?:base:layout {
+    return $this->streamingLayout;
+  }
+
+  private function streamHead(): void {
+    if ($this instanceof BaseListener ||
+      $this->isXHR() ||
+      $this->isJSONForced()) {
+      return;
+    }
+
+    $layout = $this->createStreamingLayout();
+    if ($layout === null) {
+      return;
+    }
+
+    BaseProfiler::sendHeader();
+    if (BaseLayoutHelper::streamHead($layout)) {
+      $this->streamingLayout = $layout;
+    }
+  }
+
+  // Once the head has been streamed, the rest of the page has to be
+  // streamed as well.
+  private function echoLayout($layout): void {
+    if ($this->streamingLayout !== null &&
+      method_exists($layout, 'renderBody') &&
+      BaseLayoutHelper::streamBody($layout)) {
+      return;
+    }
+
+    $html = BaseLayoutHelper::render($layout);
+    BaseProfiler::sendHeader();
+    echo $html;
+  }
+
   protected function isXHR() {
     $http_x_requested_with = idx($_SERVER, 'HTTP_X_REQUESTED_WITH');
     // WebView workaround
@@ -71,6 +211,7 @@ class BaseController {
   }
 
   protected function status(int $status): void {
+    BaseView::recordStatus($status);
     if ($status == 404) {
       header('HTTP/1.0 404 Not Found');
     } else {
@@ -92,26 +233,10 @@ class BaseController {
         $this->render();
       } elseif ($this->isXHR() || $this->isJSONForced()) {
         $view = $this->renderJSON();
+        BaseProfiler::sendHeader();
         $view->render();
       } else {
-        $layout = $this->render();
-        // Pre-render layout in order to trigger widgets' CSSs and JSs
-        $layout->__toString();
-        if (method_exists($layout, 'hasSection')) {
-          if ($layout->hasSection('stylesheets')) {
-            foreach (BaseLayoutHelper::stylesheets() as $css) {
-              $layout->section('stylesheets')->appendChild($css);
-            }
-          }
-
-          if ($layout->hasSection('javascripts')) {
-            foreach (BaseLayoutHelper::javascripts() as $js) {
-              $layout->section('javascripts')->appendChild($js);
-            }
-          }
-        }
-
-        echo $layout;
+        $this->echoLayout($this->render());
       }
     } catch (Exception $e) {
       l($e);
@@ -132,6 +257,7 @@ class BaseController {
     } elseif ($this->isXHR()) {
       if (method_exists($this, 'renderJSONError')) {
         $view = $this->renderJSONError($e);
+        BaseProfiler::sendHeader();
         $view->render();
       } else {
         $this->status(404);
@@ -139,28 +265,16 @@ class BaseController {
       }
 
     } else {
-      if (method_exists($this, 'renderError')) {
+      if (method_exists($this, 'renderError') &&
+        $this->streamingLayout !== null) {
+        $this->streamError($e);
+
+      } elseif (method_exists($this, 'renderError')) {
         $layout = $this->renderError($e);
         if (!$layout) {
           return;
         }
-        // Pre-render layout in order to trigger widgets' CSSs and JSs
-        $layout->__toString();
-        if (method_exists($layout, 'hasSection')) {
-          if ($layout->hasSection('stylesheets')) {
-            foreach (BaseLayoutHelper::stylesheets() as $css) {
-              $layout->section('stylesheets')->appendChild($css);
-            }
-          }
-
-          if ($layout->hasSection('javascripts')) {
-            foreach (BaseLayoutHelper::javascripts() as $js) {
-              $layout->section('javascripts')->appendChild($js);
-            }
-          }
-        }
-
-        echo $layout;
+        $this->echoLayout($layout);
 
       } else {
         $this->status(404);
@@ -169,10 +283,30 @@ class BaseController {
     }
   }
 
+  // Once the head has been sent, the error is rendered as the body of the
+  // streamed layout. Status and headers set by renderError() are only
+  // logged.
+  private function streamError(Exception $e): void {
+    set_error_handler([$this, 'lateHeader'], E_WARNING);
+    try {
+      $error = $this->renderError($e);
+      $body = null;
+      if ($error && method_exists($error, 'renderBody')) {
+        $body = $error->renderBody();
+      } elseif ($error) {
+        $body = <body>{$error}</body>;
+      }
+      BaseLayoutHelper::streamError($this->streamingLayout, $body ?: <body />);
+    } finally {
+      restore_error_handler();
+    }
+  }
+
   // Called when the controller executes getFlow with success. Override this
   // method when you need to send extra field in your response.
   // protected function render() {echo '';}
-  protected function renderJSON(): BaseJSONView {
+  // Return a BaseJSONStreamView for large collections.
+  protected function renderJSON(): BaseView {
     $view = new BaseJSONView();
     $view->success();
     return $view;
@@ -208,15 +342,74 @@ class BaseController {
 
 abstract class BaseView {
   protected $status;
+  protected static int $responseStatus = 200;
 
   public function __construct() {
     $this->status = 200;
   }
 
   public function status(int $code = 200) {
+    self::recordStatus($code);
     http_response_code($code);
   }
 
+  // Statuses set through the framework are tracked here as well, since
+  // http_response_code() stops changing once the headers have been sent.
+  public static function recordStatus(int $code): void {
+    self::$responseStatus = $code;
+  }
+
+  public static function responseStatus(): int {
+    return self::$responseStatus;
+  }
+
+  // Sends the ETag and Last-Modified validators and answers the request
+  // with a 304 when the client's copy is current. If-Modified-Since is
+  // only considered when the request has no If-None-Match.
+  public static function notModified(
+    ?string $etag,
+    ?int $last_modified = null): bool {
+    $method = idx($_SERVER, 'REQUEST_METHOD');
+    if ($method !== 'GET' && $method !== 'HEAD') {
+      return false;
+    }
+
+    if ($etag !== null) {
+      if ($etag === '' || $etag[0] !== '"') {
+        $etag = '"' . $etag . '"';
+      }
+      header('ETag: ' . $etag);
+    }
+
+    if ($last_modified !== null) {
+      header('Last-Modified: ' .
+        gmdate('D, d M Y H:i:s', $last_modified) . ' GMT');
+    }
+
+    $if_none_match = idx($_SERVER, 'HTTP_IF_NONE_MATCH');
+    $if_modified_since = idx($_SERVER, 'HTTP_IF_MODIFIED_SINCE');
+    $not_modified = false;
+
+    if ($if_none_match !== null) {
+      foreach (explode(',', $if_none_match) as $candidate) {
+        $candidate = preg_replace('/^W\//', '', trim($candidate));
+        if ($candidate === '*' || ($etag !== null && $candidate === $etag)) {
+          $not_modified = true;
+          break;
+        }
+      }
+    } elseif ($if_modified_since !== null && $last_modified !== null) {
+      $since = strtotime($if_modified_since);
+      $not_modified = $since !== false && $last_modified <= $since;
+    }
+
+    if ($not_modified) {
+      self::recordStatus(304);
+      http_response_code(304);
+    }
+    return $not_modified;
+  }
+
   abstract public function render(bool $return_instead_of_echo);
 }
 
@@ -256,26 +449,13 @@ abstract class StaticPageController {
 
   private function out(): void {
     $layout = $this->render();
-    $layout->__toString();
-    if (method_exists($layout, 'hasSection')) {
-      if ($layout->hasSection('stylesheets')) {
-        foreach (BaseLayoutHelper::stylesheets() as $css) {
-          $layout->section('stylesheets')->appendChild($css);
-        }
-      }
-
-      if ($layout->hasSection('javascripts')) {
-        foreach (BaseLayoutHelper::javascripts() as $js) {
-          $layout->section('javascripts')->appendChild($js);
-        }
-      }
-
-      if ($layout->hasSection('body')) {
-        $layout->section('body')->appendChild($this->getFileContents());
-      }
+    if (method_exists($layout, 'hasSection') && $layout->hasSection('body')) {
+      $layout->section('body')->appendChild($this->getFileContents());
     }
 
-    echo $layout;
+    $html = BaseLayoutHelper::render($layout);
+    BaseProfiler::sendHeader();
+    echo $html;
   }
 
   abstract public function render();
@@ -294,6 +474,29 @@ class BaseListener extends BaseController {
 
 class BaseJSONView extends BaseView {
   private array<string, mixed> $_payload;
+  private ?string $_etag = null;
+  private ?int $_lastModified = null;
+  private bool $_serializeModels = false;
+
+  // Encodes the payload with BaseModelSerializer (see
+  // BaseModel::jsonFields) instead of json_encode.
+  public final function serializeModels(bool $enabled = true): this {
+    $this->_serializeModels = $enabled;
+    return $this;
+  }
+
+  // Validators for the payload. When set, render() answers conditional
+  // requests with a 304 without serializing anything.
+  public final function etag(string $etag): this {
+    $this->_etag = $etag;
+    return $this;
+  }
+
+  public final function lastModified(int $timestamp): this {
+    $this->_lastModified = $timestamp;
+    return $this;
+  }
+
   public final function success(
     ?array<string, mixed> $data = null,
     int $http_status = 200): this {
@@ -323,14 +526,97 @@ class BaseJSONView extends BaseView {
     return $this;
   }
 
+  private function encode(): string {
+    return $this->_serializeModels ?
+      BaseModelSerializer::encode($this->_payload) :
+      json_encode($this->_payload);
+  }
+
   public final function render(bool $return_instead_of_echo = false) {
     if ($return_instead_of_echo) {
-      return json_encode($this->_payload);
+      return $this->encode();
     } else {
       header('Access-Control-Allow-Origin: *');
+      if (($this->_etag !== null || $this->_lastModified !== null) &&
+        BaseView::notModified($this->_etag, $this->_lastModified)) {
+        return;
+      }
       header('Content-type: application/json; charset: utf-8');
-      echo json_encode($this->_payload);
+      echo $this->encode();
+    }
+  }
+}
+
+// Streams {"success":true,"data":[...]} from any Traversable, e.g.
+// BaseStore::load(), encoding and flushing items as they come, so memory
+// does not grow with the size of the result.
+class BaseJSONStreamView extends BaseView {
+  const int FLUSH_EVERY = 100;
+
+  private Traversable $_items;
+  private ?(function(mixed): mixed) $_mapper = null;
+  private bool $_serializeModels = false;
+
+  // $mapper converts each item before encoding. Models are encoded
+  // through document() by default.
+  public final function success(
+    Traversable $items,
+    ?(function(mixed): mixed) $mapper = null,
+    int $http_status = 200): this {
+
+    $this->status($http_status);
+    $this->_items = $items;
+    $this->_mapper = $mapper;
+    return $this;
+  }
+
+  // Encodes items with BaseModelSerializer instead of json_encode.
+  public final function serializeModels(bool $enabled = true): this {
+    $this->_serializeModels = $enabled;
+    return $this;
+  }
+
+  protected function encode(mixed $item): string {
+    $mapper = $this->_mapper;
+    if ($mapper !== null) {
+      $item = $mapper($item);
+    }
+
+    if ($this->_serializeModels) {
+      return BaseModelSerializer::encode($item);
+    }
+
+    if ($item instanceof BaseModel) {
+      $item = $item->document();
     }
+    return json_encode($item);
+  }
+
+  public final function render(bool $return_instead_of_echo = false) {
+    if ($return_instead_of_echo) {
+      $items = [];
+      foreach ($this->_items as $item) {
+        $items[] = $this->encode($item);
+      }
+      return '{"success":true,"data":[' . implode(',', $items) . ']}';
+    }
+
+    header('Access-Control-Allow-Origin: *');
+    header('Content-type: application/json; charset: utf-8');
+
+    echo '{"success":true,"data":[';
+    $count = 0;
+    foreach ($this->_items as $item) {
+      echo ($count > 0 ? ',' : '') . $this->encode($item);
+      if (++$count % self::FLUSH_EVERY === 0) {
+        BaseResponseCompression::stream();
+        if (ob_get_level() > 0) {
+          ob_flush();
+        }
+        flush();
+      }
+    }
+    echo ']}';
   }
 }
 
@@ -531,14 +817,59 @@ class BaseNotFoundController extends BaseController {
   }
 }
 
+// Serves the bundles behind the dynamic_resource route. Applications
+// route it to a controller extending this one, e.g.
+// class DynamicResourceController extends BaseResourceController {}
+class BaseResourceController extends BaseController {
+  protected function params() {
+    return [
+      BaseParam::StringType('type'),
+      BaseParam::StringType('hash'),
+      BaseParam::StringType('c', ''),
+    ];
+  }
+
+  protected function genFlow() {
+    BaseLayoutHelper::serve($this->param('hash'));
+    die;
+  }
+}
+
+// Runs BaseWarmup and reports its results. Applications route it to a
+// controller extending this one and hit it before putting the instance in
+// rotation, e.g. class WarmupController extends BaseWarmupController {}
+// It runs in the server process so that it warms the server's APC, and
+// only for requests sending WARMUP_TOKEN in the X-Warmup-Token header.
+class BaseWarmupController extends BaseController {
+  protected function genFlow() {
+    $view = new BaseJSONView();
+    $token = BaseConfig::getString('WARMUP_TOKEN');
+    $sent = (string)idx($_SERVER, 'HTTP_X_WARMUP_TOKEN', '');
+    if ($token === '' || !hash_equals($token, $sent)) {
+      $view->error('Forbidden', 403);
+    } else {
+      try {
+        $view->success(BaseWarmup::run());
+      } catch (Exception $e) {
+        $view->error($e->getMessage(), 503);
+      }
+    }
+    $view->render();
+    die;
+  }
+}
+
 class ApiRunner {
   protected
     $listeners,
     $pathInfo,
     $params,
-    $paramNames;
+    $paramNames,
+    $paramNamesPath;
 
   protected static array $map = [];
+  protected static array<string, array> $routes = [];
+  protected static ?string $route = null;
 
   public function __construct($map) {
     self::$map = $map;
@@ -551,6 +882,11 @@ class ApiRunner {
     return self::$map;
   }
 
+  // Name of the route matched by the current request, if any.
+  public static function currentRoute(): ?string {
+    return self::$route;
+  }
+
   protected function getPathInfo() {
     if ($this->pathInfo) {
       return $this->pathInfo;
@@ -576,24 +912,62 @@ class ApiRunner {
     return $this->pathInfo;
   }
 
-  public function matches($resourceUri, $pattern)
-  {
-      //Convert URL params into regex patterns, construct a regex for this route, init params
+  // The regexes of every route in the map, compiled once per route map and
+  // kept in APC.
+  public function compileRoutes(): array<string, array> {
+    $key = 'base:routes:' . md5(serialize(self::$map));
+    if (isset(self::$routes[$key])) {
+      return self::$routes[$key];
+    }
+
+    $routes = apc_fetch($key, $success);
+    if (!$success) {
+      $routes = [];
+      foreach (self::$map as $name => $v) {
+        $routes[$name] = $this->compileRoute((string)$v['route']);
+      }
+      apc_store($key, $routes);
+    }
+
+    self::$routes[$key] = $routes;
+    return $routes;
+  }
+
+  protected function compileRoute(string $pattern): array {
+      //Convert URL params into regex patterns, construct a regex for this route
+      $this->paramNames = [];
+      $this->paramNamesPath = [];
       $patternAsRegex = preg_replace_callback('#:([\w]+)\+?#', [$this, 'matchesCallback'],
-          str_replace(')', ')?', (string) $pattern));
+          str_replace(')', ')?', $pattern));
 
       if (substr($pattern, -1) === '/') {
           $patternAsRegex .= '?';
       }
 
+      return [
+        'regex' => '#^' . $patternAsRegex . '$#',
+        'names' => $this->paramNames,
+        'paths' => $this->paramNamesPath,
+      ];
+  }
+
+  public function matches($resourceUri, $pattern)
+  {
+      return $this->matchesRoute(
+        $resourceUri,
+        $this->compileRoute((string) $pattern));
+  }
+
+  protected function matchesRoute($resourceUri, array $route)
+  {
       //Cache URL params' names and values if this route matches the current HTTP request
-      if (!preg_match('#^' . $patternAsRegex . '$#', $resourceUri, $paramValues)) {
+      if (!preg_match($route['regex'], $resourceUri, $paramValues)) {
           return false;
       }
 
-      foreach ($this->paramNames as $name) {
+      foreach ($route['names'] as $name) {
           if (isset($paramValues[$name])) {
-              if (isset($this->paramNamesPath[ $name ])) {
+              if (isset($route['paths'][ $name ])) {
                   $this->params[$name] = explode('/', urldecode($paramValues[$name]));
               } else {
                   $this->params[$name] = urldecode($paramValues[$name]);
@@ -625,9 +999,10 @@ class ApiRunner {
   }
 
   protected function selectController() {
-    foreach (self::$map as $v) {
-      if ($this->matches($this->getPathInfo(), $v['route'])) {
-        return $v['controller'];
+    foreach ($this->compileRoutes() as $key => $route) {
+      if ($this->matchesRoute($this->getPathInfo(), $route)) {
+        self::$route = $key;
+        return self::$map[$key]['controller'];
       }
     }
     return false;
@@ -635,8 +1010,8 @@ class ApiRunner {
 
   public function getRouteByURL(URL $url): Map {
     $map = Map {};
-    foreach (self::$map as $key => $v) {
-      if ($this->matches($url->path(), $v['route'])) {
+    foreach ($this->compileRoutes() as $key => $route) {
+      if ($this->matchesRoute($url->path(), $route)) {
         $map['route'] = $key;
         $map['params'] = $this->params;
         break;
@@ -682,6 +1057,7 @@ class ApiRunner {
       return false;
     }
 
+    $t = BaseProfiler::start();
     foreach ($this->listeners[$event] as $controller_name) {
       $controller = new $controller_name(
         $this->getPathInfo(),
@@ -689,6 +1065,7 @@ class ApiRunner {
         $this->getFiles(),
         $this->canAccessRestrictedEndpoints());
     }
+    BaseProfiler::stop('event-' . $event, $t);
   }
 
   protected function getAllHeaders(): array {
@@ -706,7 +1083,9 @@ class ApiRunner {
     $this->fireEvent('preprocess');
 
     $method = $this->getRequestMethod();
+    $t = BaseProfiler::start();
     $controller_path = $this->selectController();
+    BaseProfiler::stop('routing', $t);
     $is_mutator = false;
 
     if (false === $controller_path) {
@@ -763,87 +1142,482 @@ class ApiRunner {
       return null;
     }
 
-    $controller = new $controller_name(
+    BaseResponseCompression::start(
+      method_exists($controller_name, 'compressionLevel') ?
+        $controller_name::compressionLevel() :
+        BaseController::compressionLevel());
+
+    // StaticPageController routes have no page cache hooks.
+    $page_key = $method === 'GET' &&
+      is_subclass_of($controller_name, 'BaseController') ?
+        BasePageCache::key($controller_name, $this->getPathInfo()) :
+        null;
+
+    if ($page_key === null) {
+      $controller = $this->createController($controller_name);
+    } else {
+      $runner = $this;
+      $factory = function() use ($runner, $controller_name) {
+        return $runner->createController($controller_name);
+      };
+
+      if (BasePageCache::serve($page_key)) {
+        if (BasePageCache::shouldRevalidate($page_key)) {
+          BasePageCache::revalidate($page_key, $controller_name, $factory);
+        }
+        $this->fireEvent('controllerEnd');
+        return null;
+      }
+
+      $controller = BasePageCache::capture(
+        $page_key,
+        $controller_name,
+        $factory);
+    }
+
+    $this->fireEvent('controllerEnd');
+    return $controller;
+  }
+
+  public function createController(string $controller_name) {
+    return new $controller_name(
       $this->getPathInfo(),
       $this->getParams(),
       $this->getFiles(),
       $this->canAccessRestrictedEndpoints());
-
-    $this->fireEvent('controllerEnd');
-    return $controller;
   }
 }
 
-class BaseRouter {
-  static protected array $params = [];
-  static private function getRouteByName(string $route_name): string {
-    $map = ApiRunner::getMap();
-    invariant($map, 'Cannot get route map.');
-
-    invariant(idx($map, $route_name), 'Route not found: %s', $route_name);
-
-    invariant(
-      idx($map[$route_name], 'route') && idx($map[$route_name], 'controller'),
-      'Route or controller name not found for route %s', $route_name);
+// Compresses responses when RESPONSE_COMPRESSION is enabled. The body is
+// buffered and compressed once it is complete, if it is at least
+// RESPONSE_COMPRESSION_MIN_SIZE bytes (1024 by default) and of a textual
+// type, with the best encoding the client accepts. Responses that are
+// flushed early (streamed layouts, BaseJSONStreamView) must call stream()
+// first, and are sent uncompressed.
+class BaseResponseCompression {
+  protected static ?BaseResponseCompression $active = null;
+
+  protected string $buffer = '';
+  protected bool $passthrough = false;
+  protected bool $recording = false;
+  protected string $recorded = '';
+  protected int $depth = 0;
+
+  public function __construct(protected int $level) {}
+
+  public static function start(int $level): bool {
+    if (!BaseConfig::getBool('RESPONSE_COMPRESSION') || $level <= 0) {
+      return false;
+    }
 
-    return $map[$route_name]['route'];
+    self::$active = new BaseResponseCompression(min($level, 9));
+    if (!ob_start([self::$active, 'handle'])) {
+      self::$active = null;
+      return false;
+    }
+    self::$active->depth = ob_get_level();
+    return true;
   }
 
-  static public function getParameterizedRoute(
-    string $route,
-    mixed $matches,
-    array $params = []): URL {
-    foreach ($matches[0] as $m) {
-      $isMandatoryParam = $m[0] === '/' ? true : false;
-      $paramName = $isMandatoryParam
-        ? str_replace('/:', '', $m)
-        : preg_replace('/\(\/:(\w+)\)/i', '$1', $m);
-      $param = idx($params, $paramName);
-      self::$params[$paramName] = $param;
-      $find = $isMandatoryParam && $param
-        ? ':' . $paramName
-        : '(/:' . $paramName . ')';
-      $replace = !$isMandatoryParam && $param
-        ? '/' . $param : $param;
+  // Called before flushing a response early. The buffered output is sent
+  // uncompressed and the buffer is ended, unless it is being recorded or
+  // other buffers sit above it, in which case it passes output through.
+  public static function stream(): void {
+    $active = self::$active;
+    if ($active === null || $active->passthrough) {
+      return;
+    }
 
-      if ($isMandatoryParam && !$param) {
-        invariant_violation($paramName . ' is a mandatory parameter.');
-      }
-      $route = str_replace($find, $replace, $route);
+    $active->passthrough = true;
+    if (!$active->recording && ob_get_level() === $active->depth) {
+      ob_end_flush();
+      self::$active = null;
     }
-    return new URL($route);
   }
 
-  static public function addOptionalParameter(
-    URL $url, mixed $optionalParams
-  ): URL {
-    $paramsKeys = array_keys(self::$params);
-    $optionalParamsKeys = array_keys($optionalParams);
-    $diffArray = array_diff($optionalParamsKeys, $paramsKeys);
-    foreach ($diffArray as $p) {
-      $url->query($p, (string) $optionalParams[$p]);
+  // Keeps a copy of the uncompressed output from now on, so that the page
+  // cache does not need a buffer of its own above this one. False when
+  // this buffer is not the current one.
+  public static function record(): bool {
+    $active = self::$active;
+    if ($active === null || ob_get_level() !== $active->depth) {
+      return false;
     }
-    return $url;
+
+    $active->recording = true;
+    $active->recorded = '';
+    return true;
   }
 
-  static public function generateUrl(
-    string $route_name,
-    array $params = []
-  ): URL {
-    $matches = [];
-    $route = self::getRouteByName($route_name);
-    preg_match_all('#\(?\/:\w+\)?#', $route, $matches);
-    $url = self::getParameterizedRoute($route, $matches, $params);
-    if ($params) {
-      $url = self::addOptionalParameter($url, $params);
+  // The output since record(), which stops recording.
+  public static function recorded(): string {
+    $active = self::$active;
+    invariant($active !== null, 'No response compression buffer');
+
+    $recorded = $active->recorded;
+    if (ob_get_level() === $active->depth) {
+      $recorded .= (string)ob_get_contents();
     }
-    self::$params = [];
-    return $url;
+    $active->recording = false;
+    $active->recorded = '';
+    return $recorded;
   }
-}
 
-abstract class BaseEnum {
-  protected $value;
+  // Whether the client accepts $encoding, i.e. lists it in Accept-Encoding
+  // without q=0.
+  public static function accepts(string $encoding): bool {
+    return (bool)preg_match(
+      '/\b' . preg_quote($encoding, '/') .
+        '\b(?!\s*;\s*q=0(\.0*)?\s*(,|$))/',
+      (string)idx($_SERVER, 'HTTP_ACCEPT_ENCODING', ''));
+  }
+
+  public function handle(string $chunk, int $phase): string {
+    if ($this->recording) {
+      $this->recorded .= $chunk;
+    }
+
+    if ($this->passthrough) {
+      $body = $this->buffer . $chunk;
+      $this->buffer = '';
+      return $body;
+    }
+
+    $this->buffer .= $chunk;
+    if (!($phase & PHP_OUTPUT_HANDLER_FINAL)) {
+      return '';
+    }
+
+    $body = $this->buffer;
+    $this->buffer = '';
+    if (!$this->compressible()) {
+      return $body;
+    }
+
+    header('Vary: Accept-Encoding', false);
+    $encoding = $this->negotiate($body);
+    if ($encoding === null) {
+      return $body;
+    }
+
+    $compressed = $encoding === 'br' ?
+      brotli_compress($body, $this->level) :
+      gzencode($body, $this->level);
+    if ($compressed === false) {
+      return $body;
+    }
+
+    header('Content-Encoding: ' . $encoding);
+    header_remove('Content-Length');
+    return $compressed;
+  }
+
+  // Whether the response could be compressed for some client, which is
+  // when it needs Vary: Accept-Encoding.
+  protected function compressible(): bool {
+    if (headers_sent()) {
+      return false;
+    }
+
+    $status = http_response_code();
+    if ($status == 204 || $status == 304) {
+      return false;
+    }
+
+    $content_type = 'text/html';
+    foreach (headers_list() as $header) {
+      if (stripos($header, 'Content-Encoding:') === 0) {
+        return false;
+      }
+      if (stripos($header, 'Content-Type:') === 0) {
+        $content_type = strtolower($header);
+      }
+    }
+
+    return (bool)preg_match('/text\/|json|javascript|xml/', $content_type);
+  }
+
+  protected function negotiate(string $body): ?string {
+    $min_size = BaseConfig::getInt('RESPONSE_COMPRESSION_MIN_SIZE', 1024);
+    if (strlen($body) < $min_size) {
+      return null;
+    }
+
+    foreach (['br', 'gzip'] as $encoding) {
+      if (self::accepts($encoding) &&
+        ($encoding !== 'br' || function_exists('brotli_compress'))) {
+        return $encoding;
+      }
+    }
+    return null;
+  }
+}
+
+// Full-page cache for anonymous GET requests (see
+// BaseController::pageCacheTTL). Requests carrying one of the cookies in
+// PAGE_CACHE_BYPASS_COOKIES (comma-separated, PHPSESSID by default) or
+// made via XHR always reach the controller.
+class BasePageCache {
+  protected static ?array $entry = null;
+
+  // Response headers stored with a page and replayed on hits.
+  protected static array<string> $replayedHeaders = [
+    'cache-control',
+    'content-language',
+    'content-type',
+    'etag',
+    'expires',
+    'last-modified',
+    'link',
+    'vary',
+  ];
+
+  public static function key(string $controller_name, string $path): ?string {
+    if ($controller_name::pageCacheTTL() <= 0) {
+      return null;
+    }
+
+    if (idx($_SERVER, 'HTTP_X_REQUESTED_WITH')) {
+      return null;
+    }
+
+    $cookies =
+      BaseConfig::getString('PAGE_CACHE_BYPASS_COOKIES') ?: 'PHPSESSID';
+    foreach (explode(',', $cookies) as $cookie) {
+      if (idx($_COOKIE, trim($cookie)) !== null) {
+        return null;
+      }
+    }
+
+    $vary = [];
+    foreach ($controller_name::pageCacheVary() as $param) {
+      $vary[$param] = idx($_GET, $param);
+    }
+
+    return sprintf(
+      'base:page:%s:%s:%s',
+      ApiRunner::currentRoute(),
+      EnvProvider::getLocale(),
+      sha1($path . ':' . serialize($vary)));
+  }
+
+  public static function serve(string $key): bool {
+    $entry = BaseCache::get($key);
+    if (!is_array($entry) || !isset($entry['headers'])) {
+      return false;
+    }
+
+    self::$entry = $entry;
+    $stale = $entry['expires'] < time();
+    $sent = [];
+    foreach ($entry['headers'] as $header) {
+      $name = self::headerName($header);
+      header($header, !isset($sent[$name]));
+      $sent[$name] = true;
+    }
+    header('X-Page-Cache: ' . ($stale ? 'STALE' : 'HIT'));
+
+    $etag = self::headerValue($entry['headers'], 'etag');
+    $last_modified = self::headerValue($entry['headers'], 'last-modified');
+    if (($etag !== null || $last_modified !== null) &&
+      BaseView::notModified(
+        $etag,
+        $last_modified !== null ? strtotime($last_modified) : null)) {
+      return true;
+    }
+
+    echo $entry['body'];
+    return true;
+  }
+
+  protected static function headerName(string $header): string {
+    return strtolower(trim((string)strstr($header, ':', true)));
+  }
+
+  protected static function headerValue(
+    array<string> $headers,
+    string $name): ?string {
+    foreach ($headers as $header) {
+      if (self::headerName($header) === $name) {
+        return trim(substr($header, strpos($header, ':') + 1));
+      }
+    }
+    return null;
+  }
+
+  // When revalidating, the controller's header() calls failed, so the
+  // previous page's headers are kept, but not its validators.
+  protected static function responseHeaders(bool $revalidating): array<string> {
+    $headers = [];
+    $sources = $revalidating ?
+      (array)idx(self::$entry, 'headers', []) :
+      headers_list();
+    foreach ($sources as $header) {
+      $name = self::headerName($header);
+      if (in_array($name, self::$replayedHeaders) &&
+        !($revalidating && ($name === 'etag' || $name === 'last-modified'))) {
+        $headers[] = $header;
+      }
+    }
+
+    if (self::headerValue($headers, 'content-type') === null) {
+      $headers[] = 'Content-Type: text/html; charset=utf-8';
+    }
+    return $headers;
+  }
+
+  // Only one request regenerates a stale page; the others keep serving
+  // the stale copy.
+  public static function shouldRevalidate(string $key): bool {
+    return self::$entry !== null &&
+      self::$entry['expires'] < time() &&
+      BaseCache::add($key . ':lock', true, 30);
+  }
+
+  public static function revalidate(
+    string $key,
+    string $controller_name,
+    (function(): mixed) $factory): void {
+    // The response has been sent by now, so the controller's header()
+    // calls can only fail; its status is read from BaseView instead.
+    $regenerate = function() use ($key, $controller_name, $factory) {
+      set_error_handler(
+        function($errno, $message) {
+          return strpos($message, 'headers already sent') !== false;
+        },
+        E_WARNING);
+      try {
+        BasePageCache::capture($key, $controller_name, $factory, false);
+      } finally {
+        restore_error_handler();
+      }
+    };
+
+    if (function_exists('register_postsend_function')) {
+      register_postsend_function($regenerate);
+    } else {
+      register_shutdown_function($regenerate);
+    }
+  }
+
+  // Runs the controller and stores its output if it succeeded with a 200.
+  // Output still reaches the client as it is produced, so streaming
+  // layouts keep working.
+  public static function capture(
+    string $key,
+    string $controller_name,
+    (function(): mixed) $factory,
+    bool $output = true) {
+    BaseView::recordStatus(200);
+    $revalidating = headers_sent();
+    $body = '';
+    $recording = $output && BaseResponseCompression::record();
+    if (!$recording) {
+      ob_start(function($chunk) use (&$body, $output) {
+        $body .= $chunk;
+        return $output ? $chunk : '';
+      });
+    }
+
+    try {
+      $controller = $factory();
+    } finally {
+      if ($recording) {
+        $body = BaseResponseCompression::recorded();
+      } else {
+        ob_end_flush();
+      }
+    }
+
+    $status = $revalidating ?
+      BaseView::responseStatus() :
+      http_response_code();
+    if ($controller->done() && $status == 200) {
+      $ttl = $controller_name::pageCacheTTL();
+      BaseCache::set(
+        $key,
+        [
+          'body' => $body,
+          'headers' => self::responseHeaders($revalidating),
+          'expires' => time() + $ttl,
+        ],
+        $ttl + $controller_name::pageCacheStale());
+    }
+
+    return $controller;
+  }
+}
+
+class BaseRouter {
+  static protected array $params = [];
+  static private function getRouteByName(string $route_name): string {
+    $map = ApiRunner::getMap();
+    invariant($map, 'Cannot get route map.');
+
+    invariant(idx($map, $route_name), 'Route not found: %s', $route_name);
+
+    invariant(
+      idx($map[$route_name], 'route') && idx($map[$route_name], 'controller'),
+      'Route or controller name not found for route %s', $route_name);
+
+    return $map[$route_name]['route'];
+  }
+
+  static public function getParameterizedRoute(
+    string $route,
+    mixed $matches,
+    array $params = []): URL {
+    foreach ($matches[0] as $m) {
+      $isMandatoryParam = $m[0] === '/' ? true : false;
+      $paramName = $isMandatoryParam
+        ? str_replace('/:', '', $m)
+        : preg_replace('/\(\/:(\w+)\)/i', '$1', $m);
+      $param = idx($params, $paramName);
+      self::$params[$paramName] = $param;
+      $find = $isMandatoryParam && $param
+        ? ':' . $paramName
+        : '(/:' . $paramName . ')';
+      $replace = !$isMandatoryParam && $param
+        ? '/' . $param : $param;
+
+      if ($isMandatoryParam && !$param) {
+        invariant_violation($paramName . ' is a mandatory parameter.');
+      }
+      $route = str_replace($find, $replace, $route);
+    }
+    return new URL($route);
+  }
+
+  static public function addOptionalParameter(
+    URL $url, mixed $optionalParams
+  ): URL {
+    $paramsKeys = array_keys(self::$params);
+    $optionalParamsKeys = array_keys($optionalParams);
+    $diffArray = array_diff($optionalParamsKeys, $paramsKeys);
+    foreach ($diffArray as $p) {
+      $url->query($p, (string) $optionalParams[$p]);
+    }
+    return $url;
+  }
+
+  static public function generateUrl(
+    string $route_name,
+    array $params = []
+  ): URL {
+    $matches = [];
+    $route = self::getRouteByName($route_name);
+    preg_match_all('#\(?\/:\w+\)?#', $route, $matches);
+    $url = self::getParameterizedRoute($route, $matches, $params);
+    if ($params) {
+      $url = self::addOptionalParameter($url, $params);
+    }
+    self::$params = [];
+    return $url;
+  }
+}
+
+abstract class BaseEnum {
+  protected $value;
   /**
    * Allows to reference a BaseEnum's value by calling:
    * AVeryLongEnumName::MY_VALUE()
@@ -898,21 +1672,59 @@ abstract class BaseEnum {
 }
 
 class Base {
+  const string CLASSMAP = 'classmap.hh';
+
+  protected static array<string, string> $autoloadMap = [
+    'Provider' => 'providers',
+    'Model' => 'models',
+    'Store' => 'storage',
+    'Trait' => 'traits',
+    'Enum' => 'enums',
+    'Type' => 'enums',
+    'Exception' => 'exceptions',
+    'Controller' => 'controllers',
+    'Worker' => 'workers',
+    'Listener' => 'listeners',
+    'Interface' => 'interfaces',
+  ];
+
+  protected static ?array<string, string> $classmap = null;
+
+  // Directories classes are autoloaded from.
+  public static function autoloadDirs(): array<string> {
+    return array_merge(
+      array_values(array_unique(self::$autoloadMap)),
+      ['layouts', 'widgets']);
+  }
+
+  // The classmap generated by `build.hh classmap`, lowercased class name
+  // => file.
+  public static function classmap(): array<string, string> {
+    if (self::$classmap === null) {
+      $path = BaseConfig::getString('CLASSMAP') ?: self::CLASSMAP;
+      self::$classmap = file_exists($path) ? require $path : [];
+    }
+    return self::$classmap;
+  }
+
+  // Classes are looked up in the classmap. The naming convention is only
+  // used in development, or when there is no classmap, so that new
+  // classes do not need a rebuild there.
   public static function registerAutoloader() {
     spl_autoload_register(function ($class) {
-      $map = [
-        'Provider' => 'providers',
-        'Model' => 'models',
-        'Store' => 'storage',
-        'Trait' => 'traits',
-        'Enum' => 'enums',
-        'Type' => 'enums',
-        'Exception' => 'exceptions',
-        'Controller' => 'controllers',
-        'Worker' => 'workers',
-        'Listener' => 'listeners',
-        'Interface' => 'interfaces',
-      ];
+      $classmap = self::classmap();
+      $key = strtolower($class);
+      if (isset($classmap[$key])) {
+        require $classmap[$key];
+        return;
+      }
+
+      if ($classmap &&
+        BaseConfig::getString('APPLICATION_ENV', 'prod') === 'prod') {
+        return;
+      }
+
+      $map = self::$autoloadMap;
 
       // These classes are stored in lib/base or lib/queue, so no need to
       // autoload
@@ -966,19 +1778,15 @@ class MongoInstance {
         $db_url = str_replace($auth_pattern, '', $db_url);
       }
 
-    } elseif (isset($_ENV['MONGOHQ_URL'])) {
-      $db_url = $_ENV['MONGOHQ_URL'];
-      $parts = parse_url($db_url);
-      if (idx($parts, 'user') && idx($parts, 'pass')) {
-        $auth_pattern = sprintf('%s:%s@', $parts['user'], $parts['pass']);
-        $db_url = str_replace($auth_pattern, '', $db_url);
-      }
+    } elseif (BaseConfig::url('MONGOHQ_URL') !== null) {
+      $parts = BaseConfig::url('MONGOHQ_URL');
+      $db_url = $parts['url'];
     } else {
       l('MongoInstance: No MONGOHQ_URL specified or invalid collection.');
       l(sprintf('MONGOHQ_URL: %s, collection: %s',
         idx($_SERVER, 'MONGOHQ_URL'),
         $collection));
-      l('_ENV[MONGOHQ_URL]:', $_ENV['MONGOHQ_URL']);
+      l('_ENV[MONGOHQ_URL]:', BaseConfig::get('MONGOHQ_URL'));
 
       throw new Exception('No MONGOHQ_URL specified');
       return null;
@@ -1005,6 +1813,66 @@ class MongoInstance {
   }
 }
 
+class RedisInstance {
+  protected static $client;
+  public static function get() {
+    if (self::$client) {
+      return self::$client;
+    }
+
+    $url = BaseConfig::url('REDISCLOUD_URL');
+    invariant($url !== null, 'Please specify an instance of Redis');
+
+    self::$client = new Predis\Client([
+      'host' => idx($url, 'host'),
+      'port' => idx($url, 'port'),
+      'password' => idx($url, 'pass')]);
+    return self::$client;
+  }
+}
+
+// Key/value cache shared across requests. BASE_CACHE_BACKEND selects APC
+// (the default, local to each HHVM instance) or Redis (shared by all
+// instances, through RedisInstance).
+class BaseCache {
+  protected static function isRedis(): bool {
+    return BaseConfig::get('BASE_CACHE_BACKEND') === 'redis';
+  }
+
+  public static function get(string $key): mixed {
+    if (self::isRedis()) {
+      $value = RedisInstance::get()->get($key);
+      return $value === null ? null : unserialize($value);
+    }
+
+    $success = false;
+    $value = apc_fetch($key, $success);
+    return $success ? $value : null;
+  }
+
+  public static function set(string $key, mixed $value, int $ttl): void {
+    if (self::isRedis()) {
+      RedisInstance::get()->setex($key, $ttl, serialize($value));
+    } else {
+      apc_store($key, $value, $ttl);
+    }
+  }
+
+  // Stores the value only if the key does not exist yet.
+  public static function add(string $key, mixed $value, int $ttl): bool {
+    if (self::isRedis()) {
+      return (bool)RedisInstance::get()->set(
+        $key,
+        serialize($value),
+        'EX',
+        $ttl,
+        'NX');
+    }
+
+    return apc_add($key, $value, $ttl);
+  }
+}
+
 class MongoFn {
   public static function get($file, $scope = []) {
     $code = file_get_contents('mongo_functions/' . $file . '.js');
@@ -1031,9 +1899,45 @@ abstract class :base:layout extends :x:element {
     return !!idx($this->sections, $section, false);
   }
 
-  public function render(): :x:element {}
+  // Critical CSS extracted by `build.hh resources` for this layout, i.e.
+  // the regions of the stylesheets it references that are marked with
+  // /*! critical */ ... /*! endcritical */. When there is some, it is
+  // inlined and the full stylesheets are loaded without blocking render.
+  public function criticalCSS(): ?string {
+    $layout_name = self::class2element(get_called_class());
+    $layout_name = str_replace('layout:', '', $layout_name);
+    return BaseLayoutHelper::criticalCSS($layout_name);
+  }
+
+  // Layouts that can be streamed return their <head> and <body> from
+  // these instead of implementing render() directly.
+  public function renderHead(): ?:x:element {
+    return null;
+  }
+
+  public function renderBody(): ?:x:element {
+    return null;
+  }
+
+  // The <html> element, without children. Also used as the opening tag
+  // of streamed layouts.
+  public function renderHTML(): :html {
+    return <html />;
+  }
+
+  public function render(): :x:element {
+    $html = $this->renderHTML();
+    $html->appendChild($this->renderHead());
+    $html->appendChild($this->renderBody());
+    return <x:doctype>{$html}</x:doctype>;
+  }
 }
 
+// Widgets whose output only depends on their attributes can be cached:
+// return a key derived from those attributes from cacheKey() and implement
+// renderCached() instead of render(). The HTML and the stylesheets and
+// scripts registered while rendering are stored in BaseCache for
+// cacheTTL() seconds and replayed on hit, without calling renderCached().
 class :base:widget extends :x:element {
   public function init() {
     $widget_name = self::class2element(get_called_class());
@@ -1058,26 +1962,85 @@ class :base:widget extends :x:element {
     }
   }
 
-  public final function js(mixed $url): void {
+  // $loading can be 'defer' or 'async', which are set on the script tag,
+  // or 'preload', which keeps the script blocking but hints the browser
+  // to fetch it from the head.
+  public final function js(mixed $url, string $loading = ''): void {
     invariant(is_string($url) || is_array($url), 'url must be array or string');
-
-    if (is_array($url)) {
-      foreach ($url as $u) {
-        invariant(is_string($u), 'Invalid string provided');
-        BaseLayoutHelper::addJavascript(
-          <script type="text/javascript" src={$u}></script>);
+    invariant(
+      in_array($loading, ['', 'defer', 'async', 'preload']),
+      'Invalid loading mode %s', $loading);
+
+    $urls = is_array($url) ? $url : [$url];
+    foreach ($urls as $u) {
+      invariant(is_string($u), 'Invalid string provided');
+      $script = <script type="text/javascript" src={$u}></script>;
+      if ($loading === 'defer' || $loading === 'async') {
+        $script->setAttribute($loading, true);
       }
-    } elseif (is_string($url)) {
-      BaseLayoutHelper::addJavascript(
-        <script type="text/javascript" src={$url}></script>);
+      BaseLayoutHelper::addJavascript($script, false, $loading === 'preload');
     }
   }
 
-  public function render(): :x:element {}
+  protected function cacheKey(): ?string {
+    return null;
+  }
+
+  protected function cacheTTL(): int {
+    return 300;
+  }
+
+  protected function renderCached(): ?XHPRoot {
+    return null;
+  }
+
+  public function render(): XHPRoot {
+    $key = $this->cacheKey();
+    if ($key === null) {
+      return <x:frag>{$this->renderCached()}</x:frag>;
+    }
+
+    // The locale is part of the key, since widgets may contain :t tags.
+    $cache_key = sprintf(
+      'base:widget:%s:%s:%s',
+      get_called_class(),
+      EnvProvider::getLocale(),
+      $key);
+    $entry = BaseCache::get($cache_key);
+    if (is_array($entry)) {
+      BaseLayoutHelper::replay($entry['resources']);
+      return <x:frag>{new StringToHTML($entry['html'])}</x:frag>;
+    }
+
+    // Nested widgets render lazily, so the subtree is rendered here to
+    // capture everything it registers.
+    BaseLayoutHelper::startRecording();
+    try {
+      $html = (string)<x:frag>{$this->renderCached()}</x:frag>;
+    } finally {
+      $resources = BaseLayoutHelper::stopRecording();
+    }
+
+    BaseCache::set(
+      $cache_key,
+      ['html' => $html, 'resources' => $resources],
+      $this->cacheTTL());
+    return <x:frag>{new StringToHTML($html)}</x:frag>;
+  }
 }
 
 class BaseLayoutHelper {
+  const string MANIFEST = 'resources.hh';
+  const string BUNDLES_PATH = 'bundles';
+  const int BUNDLE_INDEX_TTL = 3600;
+
   protected static ?string $build;
+  protected static ?array $manifest = null;
+  protected static array<string, bool> $preloads = [];
+  protected static array<string, string> $streamMarkers = [];
+  protected static array<string, bool> $streamedStylesheets = [];
+  protected static ?array<string, bool> $streamedJavascripts = null;
+  protected static array<array> $recordings = [];
   protected static array $resources = [
     'layout' => [
       'local' => [
@@ -1097,13 +2060,26 @@ class BaseLayoutHelper {
 
   public static function addJavascript(
     :script $javascript,
-    bool $layout = false): void {
+    bool $layout = false,
+    bool $preload = false): void {
     $url = $javascript->getAttribute('src');
 
     $element = $layout ? 'layout' : 'widget';
     $origin = self::isLocal($url) ? 'local' : 'remote';
 
     self::$resources[$element][$origin]['js'][$url] = $javascript;
+    if ($preload) {
+      self::$preloads[(string)$url] = true;
+    }
+
+    self::record([
+      'js',
+      (string)$url,
+      $layout,
+      $preload,
+      (bool)$javascript->getAttribute('async'),
+      (bool)$javascript->getAttribute('defer'),
+    ]);
   }
 
   public static function addStylesheet(
@@ -1115,56 +2091,75 @@ class BaseLayoutHelper {
     $origin = self::isLocal($url) ? 'local' : 'remote';
 
     self::$resources[$element][$origin]['css'][$url] = $stylesheet;
+    self::record(['css', (string)$url, $layout]);
   }
 
-  protected static function isLocal(string $url): bool {
-    return !!(preg_match('/^(https?:)?(\/\/)/', $url, []) === 0);
+  // Recordings capture the resources registered while they are active, so
+  // that cached widgets can register them again (see :base:widget).
+  // Recordings nest.
+  public static function startRecording(): void {
+    self::$recordings[] = [];
   }
 
-  protected static function cacheBuster(): string {
-    if (!EnvProvider::get('ENABLE_RESOURCES_COMPRESSION') ||
-      !EnvProvider::get('DYNAMIC_RESOURCES_CACHE_BUSTER')) {
-      return '';
+  public static function stopRecording(): array<array> {
+    return array_pop(self::$recordings);
+  }
+
+  protected static function record(array $resource): void {
+    foreach (self::$recordings as $i => $recording) {
+      self::$recordings[$i][] = $resource;
     }
+  }
 
-    if (self::$build === null) {
-      self::$build = file_exists('build') ? file_get_contents('build') : time();
+  public static function replay(array<array> $resources): void {
+    foreach ($resources as $resource) {
+      if ($resource[0] === 'css') {
+        self::addStylesheet(
+          <link rel="stylesheet" href={$resource[1]} />,
+          $resource[2]);
+      } else {
+        $script = <script type="text/javascript" src={$resource[1]}></script>;
+        if ($resource[4]) {
+          $script->setAttribute('async', true);
+        } elseif ($resource[5]) {
+          $script->setAttribute('defer', true);
+        }
+        self::addJavascript($script, $resource[2], $resource[3]);
+      }
     }
+  }
 
-    return self::$build != false ? (string)self::$build : '';
+  public static function isLocal(string $url): bool {
+    return !!(preg_match('/^(https?:)?(\/\/)/', $url, []) === 0);
   }
 
-  protected static function hash(string $type): URL {
-    switch ($type) {
-      case 'js':
-        $array = array_merge(
-          array_keys(self::$resources['layout']['local']['js']),
-          array_keys(self::$resources['widget']['local']['js']));
-        break;
-      case 'css':
-        $array = array_merge(
-          array_keys(self::$resources['layout']['local']['css']),
-          array_keys(self::$resources['widget']['local']['css']));
-        break;
+  protected static function cacheBuster(): string {
+    if (!BaseConfig::get('ENABLE_RESOURCES_COMPRESSION') ||
+      !BaseConfig::get('DYNAMIC_RESOURCES_CACHE_BUSTER')) {
+      return '';
     }
 
-    $map = $array;
-
-    // Preserve file order so that JS and CSS can respect loading priority.
-    // Layout resources go first.
-    natsort($map);
-    $map = array_values($map);
+    return self::buildId();
+  }
 
-    $hash = sha256(implode(':', $map)) . '.' . $type;
-    $file_path = sys_get_temp_dir() . '/' . $hash;
+  protected static function buildId(): string {
+    if (self::$build === null) {
+      self::$build =
+        file_exists('build') ? (string)file_get_contents('build') : '';
+    }
+    return self::$build;
+  }
 
-    if (!file_exists($file_path)) {
-      $content = '';
-      foreach ($array as $file) {
-        $content .= file_get_contents('public/' . $file) . PHP_EOL;
-      }
-      file_put_contents($file_path, $content);
+  protected static function hash(string $type, array<string> $array): URL {
+    // The bundle is named after the files in order, since the order is
+    // part of its content, the build id and the files' mtimes, so that the
+    // name changes whenever the content can.
+    $version = self::buildId();
+    foreach ($array as $file) {
+      $version .= ':' . (int)@filemtime('public/' . $file);
     }
+    $hash = sha256(implode(':', $array) . '@' . $version) . '.' . $type;
+    self::writeBundle($hash, $array);
 
     $cache_buster = self::cacheBuster();
     $route_params = [
@@ -1179,12 +2174,472 @@ class BaseLayoutHelper {
     return URL::route('dynamic_resource', $route_params);
   }
 
+  // Bundles known to exist are indexed in APC, so steady-state requests
+  // skip the filesystem entirely. Entries expire after
+  // BUNDLE_INDEX_TTL seconds in case the temp directory gets cleaned up.
+  protected static function writeBundle(
+    string $hash,
+    array<string> $files): void {
+    $index_key = 'base:bundle:' . $hash;
+    if (apc_fetch($index_key)) {
+      return;
+    }
+
+    $file_path = sys_get_temp_dir() . '/' . $hash;
+    if (!file_exists($file_path)) {
+      // Only one request builds a given bundle. The others wait for the
+      // lock and find the file once it is released. The file is renamed
+      // into place, so readers never see a partial bundle, and requests
+      // that cannot create the lock just build it concurrently.
+      $lock_path = $file_path . '.lock';
+      $lock = @fopen($lock_path, 'c');
+      if ($lock) {
+        flock($lock, LOCK_EX);
+        clearstatcache(true, $file_path);
+      }
+      if (!file_exists($file_path)) {
+        $type = substr($hash, strrpos($hash, '.') + 1);
+        $content = '';
+        foreach ($files as $file) {
+          $content .= BaseMinifier::file($type, 'public/' . $file) .
+            ($type === 'js' ? ';' : '') . PHP_EOL;
+        }
+
+        // Compressed siblings go first: once the bundle itself exists,
+        // they do too.
+        self::writeCompressed($file_path, $content);
+        self::writeAtomic($file_path, $content);
+      }
+      if ($lock) {
+        // The bundle exists now, so later requests never look for the
+        // lock, and waiters holding it find the bundle.
+        @unlink($lock_path);
+        flock($lock, LOCK_UN);
+        fclose($lock);
+      }
+    }
+
+    apc_store($index_key, true, self::BUNDLE_INDEX_TTL);
+  }
+
+  protected static function writeAtomic(string $path, string $content): void {
+    $tmp = tempnam(dirname($path), basename($path));
+    file_put_contents($tmp, $content);
+    chmod($tmp, 0644);
+    rename($tmp, $path);
+  }
+
+  // Writes .gz and, when HHVM has brotli support, .br siblings of a bundle
+  // so that serve() never compresses on request.
+  public static function writeCompressed(string $path, string $content): void {
+    self::writeAtomic($path . '.gz', gzencode($content, 9));
+    if (function_exists('brotli_compress')) {
+      self::writeAtomic($path . '.br', brotli_compress($content));
+    }
+  }
+
+  // Serves a bundle built by hash(). Its name changes with its content, so
+  // responses are cached as immutable. The ETag only depends on the
+  // bundle's name, size and mtime, so conditional requests are answered
+  // with a 304 after a single stat.
+  public static function serve(string $hash): bool {
+    $type = [];
+    if (!preg_match('/^[a-f0-9]{64}\.(css|js)$/', $hash, $type)) {
+      http_response_code(404);
+      return false;
+    }
+
+    $file_path = sys_get_temp_dir() . '/' . $hash;
+    $stat = @stat($file_path);
+    if ($stat === false) {
+      http_response_code(404);
+      return false;
+    }
+
+    $etag = sprintf(
+      '"%s-%x-%x"',
+      substr($hash, 0, 16),
+      $stat['mtime'],
+      $stat['size']);
+
+    header('ETag: ' . $etag);
+    header('Vary: Accept-Encoding');
+    header('Cache-Control: public, max-age=31536000, immutable');
+
+    $if_none_match = idx($_SERVER, 'HTTP_IF_NONE_MATCH');
+    if ($if_none_match !== null &&
+      in_array($etag, array_map('trim', explode(',', $if_none_match)))) {
+      http_response_code(304);
+      return true;
+    }
+
+    foreach (['br' => '.br', 'gzip' => '.gz'] as $encoding => $extension) {
+      if (BaseResponseCompression::accepts($encoding) &&
+        file_exists($file_path . $extension)) {
+        header('Content-Encoding: ' . $encoding);
+        $file_path .= $extension;
+        break;
+      }
+    }
+
+    header(
+      $type[1] === 'css' ?
+        'Content-Type: text/css; charset=utf-8' :
+        'Content-Type: application/javascript; charset=utf-8');
+    header('Content-Length: ' . filesize($file_path));
+    readfile($file_path);
+    return true;
+  }
+
+  // Bundles built by `build.hh resources`, empty when none were built.
+  public static function manifest(): array<string, array> {
+    if (self::$manifest === null) {
+      $path = BaseConfig::get('RESOURCES_MANIFEST') ?: self::MANIFEST;
+      self::$manifest = is_file($path) ? require $path : [];
+    }
+    return self::$manifest;
+  }
+
+  // Maps the requested local resources onto prebuilt bundles, keeping
+  // their registration order. A bundle is only used where its files are
+  // requested consecutively and in the same order; each run of files in
+  // between is concatenated on request.
+  protected static function bundles(string $type): array<array> {
+    $files = array_merge(
+      array_keys(self::$resources['layout']['local'][$type]),
+      array_keys(self::$resources['widget']['local'][$type]));
+    $manifest = self::manifest();
+    $bundles = idx($manifest, 'bundles', []);
+    $bundled_files = idx($manifest, 'files', []);
+
+    $urls = [];
+    $leftovers = [];
+    $count = count($files);
+    for ($i = 0; $i < $count; $i++) {
+      $file = $files[$i];
+      $bundle = null;
+      foreach (idx($bundled_files, $file, []) as $name) {
+        $size = count($bundles[$name]);
+        if (($bundle === null || $size > count($bundles[$bundle])) &&
+          array_slice($files, $i, $size) === $bundles[$name]) {
+          $bundle = $name;
+        }
+      }
+
+      if ($bundle === null) {
+        $leftovers[] = $file;
+        continue;
+      }
+
+      if ($leftovers) {
+        $urls[] = [self::hash($type, $leftovers), $leftovers];
+        $leftovers = [];
+      }
+      $urls[] = [
+        new URL('/' . self::BUNDLES_PATH . '/' . $bundle),
+        $bundles[$bundle],
+      ];
+      $i += count($bundles[$bundle]) - 1;
+    }
+
+    if ($leftovers) {
+      $urls[] = [self::hash($type, $leftovers), $leftovers];
+    }
+
+    return $urls;
+  }
+
+  // A bundle is async or deferred only if all of its scripts are, and is
+  // preloaded if any of them asked for it.
+  protected static function bundleScript(
+    URL $url,
+    array<string> $files): :script {
+    $async = true;
+    $defer = true;
+    foreach ($files as $file) {
+      $script = idx(
+        self::$resources['layout']['local']['js'],
+        $file,
+        idx(self::$resources['widget']['local']['js'], $file));
+      $async = $async && $script->getAttribute('async');
+      $defer = $defer &&
+        ($script->getAttribute('async') || $script->getAttribute('defer'));
+      if (isset(self::$preloads[$file])) {
+        self::$preloads[(string)$url] = true;
+      }
+    }
+
+    $script = <script src={$url} />;
+    if ($async) {
+      $script->setAttribute('async', true);
+    } elseif ($defer) {
+      $script->setAttribute('defer', true);
+    }
+    return $script;
+  }
+
+  public static function criticalCSS(string $layout): ?string {
+    return idx(idx(self::manifest(), 'critical', []), $layout);
+  }
+
+  // Preload hints for the head, so that scripts that are not blocking
+  // (or asked to be preloaded) are fetched while the page is parsed.
+  public static function preloads(
+    array<:script> $javascripts): array<StringToHTML> {
+    $hints = [];
+    foreach ($javascripts as $script) {
+      $src = (string)$script->getAttribute('src');
+      if ($script->getAttribute('defer') ||
+        $script->getAttribute('async') ||
+        isset(self::$preloads[$src])) {
+        $hints[] = new StringToHTML(sprintf(
+          '<link rel="preload" as="script" href="%s" />',
+          htmlspecialchars($src)));
+      }
+    }
+    return $hints;
+  }
+
+  // Loads a stylesheet without blocking render, for pages whose critical
+  // CSS has been inlined.
+  public static function deferStylesheet(:link $stylesheet): StringToHTML {
+    $href = htmlspecialchars((string)$stylesheet->getAttribute('href'));
+    return new StringToHTML(sprintf(
+      '<link rel="preload" as="style" href="%s" ' .
+      'onload="this.onload=null;this.rel=\'stylesheet\'" />' .
+      '<noscript><link rel="stylesheet" href="%s" /></noscript>',
+      $href,
+      $href));
+  }
+
+  // Resources registered so far, grouped by the layout section they go in.
+  public static function resources($layout): array<string, array> {
+    $javascripts = self::javascripts();
+    $stylesheets = [];
+
+    $critical = method_exists($layout, 'criticalCSS') ?
+      $layout->criticalCSS() :
+      null;
+    if ($critical !== null) {
+      $stylesheets[] = new StringToHTML(
+        '<style>' . str_replace('</', '<\/', $critical) . '</style>');
+    }
+
+    foreach (self::stylesheets() as $css) {
+      $stylesheets[] =
+        $critical !== null ? self::deferStylesheet($css) : $css;
+    }
+
+    return [
+      'stylesheets' => array_merge($stylesheets, self::preloads($javascripts)),
+      'javascripts' => $javascripts,
+    ];
+  }
+
+  // Renders a layout exactly once. Widgets register their stylesheets and
+  // scripts while they render, so the stylesheets and javascripts
+  // sections get a marker that is replaced with the resources once the
+  // whole tree has been rendered.
+  public static function render($layout): string {
+    if (!method_exists($layout, 'hasSection')) {
+      return (string)$layout;
+    }
+
+    $markers = self::addMarkers($layout);
+    return self::replaceMarkers($layout, (string)$layout, $markers);
+  }
+
+  protected static function addMarkers($layout): array<string, string> {
+    $markers = [];
+    foreach (['stylesheets', 'javascripts'] as $section) {
+      if ($layout->hasSection($section)) {
+        $markers[$section] = '<!--base:' . $section . '-->';
+        $layout->section($section)->appendChild(
+          new StringToHTML($markers[$section]));
+      }
+    }
+    return $markers;
+  }
+
+  protected static function replaceMarkers(
+    $layout,
+    string $html,
+    array<string, string> $markers): string {
+    $found = [];
+    foreach ($markers as $section => $marker) {
+      if (strpos($html, $marker) !== false) {
+        $found[$section] = $marker;
+      }
+    }
+
+    if (!$found) {
+      return $html;
+    }
+
+    $replacements = [];
+    foreach (self::resources($layout) as $section => $resources) {
+      if (isset($found[$section])) {
+        $replacements[$found[$section]] = self::toHTML($resources);
+      }
+    }
+
+    return strtr($html, $replacements);
+  }
+
+  protected static function toHTML(array $elements): string {
+    $frag = <x:frag />;
+    foreach ($elements as $element) {
+      $frag->appendChild($element);
+    }
+    return (string)$frag;
+  }
+
+  protected static function flush(): void {
+    BaseResponseCompression::stream();
+    if (ob_get_level() > 0) {
+      ob_flush();
+    }
+    flush();
+  }
+
+  // Sends the doctype and the layout's <head>, with the stylesheets
+  // registered so far, and flushes it to the browser. Used by controllers
+  // that stream their layout (see BaseController::streamingLayout).
+  public static function streamHead($layout): bool {
+    $head = $layout->renderHead();
+    if ($head === null) {
+      return false;
+    }
+
+    self::$streamMarkers = self::addMarkers($layout);
+    $html = self::streamChunk($layout, (string)$head);
+    foreach (self::registeredStylesheets() as $url => $stylesheet) {
+      self::$streamedStylesheets[$url] = true;
+    }
+
+    $shell = (string)$layout->renderHTML();
+    echo '<!DOCTYPE html>' . substr($shell, 0, strrpos($shell, '</')) . $html;
+    self::flush();
+    return true;
+  }
+
+  // Replaces the resource markers in a streamed chunk, and remembers which
+  // scripts went out with the javascripts section.
+  protected static function streamChunk($layout, string $html): string {
+    $marker = idx(self::$streamMarkers, 'javascripts');
+    if ($marker !== null && strpos($html, $marker) !== false) {
+      self::$streamedJavascripts = [];
+      foreach (self::registeredJavascripts() as $url => $script) {
+        self::$streamedJavascripts[$url] = true;
+      }
+    }
+    return self::replaceMarkers($layout, $html, self::$streamMarkers);
+  }
+
+  // Streams the layout's <body> one child at a time. Stylesheets that
+  // widgets register after the head has been sent are emitted right
+  // before the chunk that needed them, unbundled. So are scripts
+  // registered after the javascripts section went out, before </body>.
+  public static function streamBody($layout): bool {
+    $body = $layout->renderBody();
+    if ($body === null) {
+      return false;
+    }
+
+    $shell = clone $body;
+    $shell->replaceChildren();
+    $shell = (string)$shell;
+    $close = strrpos($shell, '</');
+
+    echo substr($shell, 0, $close);
+    foreach ($body->getChildren() as $child) {
+      $html = self::streamChunk($layout, (string)<x:frag>{$child}</x:frag>);
+
+      $late = [];
+      foreach (self::registeredStylesheets() as $url => $stylesheet) {
+        if (!isset(self::$streamedStylesheets[$url])) {
+          self::$streamedStylesheets[$url] = true;
+          $late[] = $stylesheet;
+        }
+      }
+
+      echo ($late ? self::toHTML($late) : '') . $html;
+      self::flush();
+    }
+    $late = [];
+    if (self::$streamedJavascripts !== null) {
+      foreach (self::registeredJavascripts() as $url => $script) {
+        if (!isset(self::$streamedJavascripts[$url])) {
+          self::$streamedJavascripts[$url] = true;
+          $late[] = $script;
+        }
+      }
+    }
+
+    echo ($late ? self::toHTML($late) : '') . substr($shell, $close) .
+      '</html>';
+    return true;
+  }
+
+  // Closes a streamed layout with $body instead of its own, for
+  // controllers that fail after the head was sent. Resources registered
+  // meanwhile are emitted unbundled, as in streamBody().
+  public static function streamError($layout, :x:element $body): void {
+    $html = self::streamChunk($layout, (string)$body);
+
+    $stylesheets = [];
+    foreach (self::registeredStylesheets() as $url => $stylesheet) {
+      if (!isset(self::$streamedStylesheets[$url])) {
+        self::$streamedStylesheets[$url] = true;
+        $stylesheets[] = $stylesheet;
+      }
+    }
+
+    $javascripts = [];
+    foreach (self::registeredJavascripts() as $url => $script) {
+      if (!isset(self::$streamedJavascripts[$url])) {
+        self::$streamedJavascripts[$url] = true;
+        $javascripts[] = $script;
+      }
+    }
+
+    $open = strpos($html, '>') + 1;
+    $close = strrpos($html, '</');
+    echo substr($html, 0, $open) .
+      ($stylesheets ? self::toHTML($stylesheets) : '') .
+      substr($html, $open, $close - $open) .
+      ($javascripts ? self::toHTML($javascripts) : '') .
+      substr($html, $close) . '</html>';
+  }
+
+  protected static function registeredJavascripts(): array<string, :script> {
+    return array_merge(
+      self::$resources['layout']['remote']['js'],
+      self::$resources['widget']['remote']['js'],
+      self::$resources['layout']['local']['js'],
+      self::$resources['widget']['local']['js']);
+  }
+
+  protected static function registeredStylesheets(): array<string, :link> {
+    return array_merge(
+      self::$resources['layout']['remote']['css'],
+      self::$resources['widget']['remote']['css'],
+      self::$resources['layout']['local']['css'],
+      self::$resources['widget']['local']['css']);
+  }
+
   public static function javascripts(): array<:script> {
-    if (EnvProvider::get('ENABLE_RESOURCES_COMPRESSION') == 1) {
+    if (BaseConfig::get('ENABLE_RESOURCES_COMPRESSION') == 1) {
+      $bundles = [];
+      foreach (self::bundles('js') as $bundle) {
+        list($url, $files) = $bundle;
+        $bundles[] = self::bundleScript($url, $files);
+      }
+
       return array_merge(
         self::$resources['layout']['remote']['js'],
         self::$resources['widget']['remote']['js'],
-        [<script src={self::hash('js')} />]);
+        $bundles);
     } else {
       return array_merge(
         self::$resources['layout']['remote']['js'],
@@ -1195,11 +2650,16 @@ class BaseLayoutHelper {
   }
 
   public static function stylesheets(): array<:link> {
-    if (EnvProvider::get('ENABLE_RESOURCES_COMPRESSION') == 1) {
+    if (BaseConfig::get('ENABLE_RESOURCES_COMPRESSION') == 1) {
+      $bundles = [];
+      foreach (self::bundles('css') as $bundle) {
+        $bundles[] = <link rel="stylesheet" href={$bundle[0]} />;
+      }
+
       return array_merge(
         self::$resources['layout']['remote']['css'],
         self::$resources['widget']['remote']['css'],
-        [<link rel="stylesheet" href={self::hash('css')} />]);
+        $bundles);
     } else {
       return array_merge(
         self::$resources['layout']['remote']['css'],
@@ -1210,31 +2670,131 @@ class BaseLayoutHelper {
   }
 }
 
+// Catalogs come from `build.hh translations`, or are compiled from JSON
+// into APC when that is missing or stale. Each holds the locale's strings
+// over its parent locales' and every string split into segments.
 class BaseTranslationHolder {
-  static array $projects = [];
+  static array<string, array<string, array<string, array>>> $projects = [];
 
   static protected function loadProject(string $locale, string $project): bool {
-    if (idx(static::$projects, $locale) &&
-      idx(static::$projects[$locale], $project)) {
+    if (isset(static::$projects[$locale][$project])) {
       return true;
     }
 
-    $project_path = sprintf('projects/%s/%s.json', $locale, $project);
+    $sources = static::sources($locale, $project);
+    $mtime = 0;
+    foreach ($sources as $source) {
+      $mtime = max($mtime, filemtime($source));
+    }
+
+    $compiled_path = sprintf('projects/%s/%s.hh', $locale, $project);
+    if (file_exists($compiled_path) && filemtime($compiled_path) >= $mtime) {
+      static::$projects[$locale][$project] = require $compiled_path;
+      return true;
+    }
 
-    if (!file_exists($project_path)) {
-      l('The requested translation project is missing:', $project_path);
-      static::$projects[$locale][$project] = [];
+    if (!$sources) {
+      l(
+        'The requested translation project is missing:',
+        sprintf('projects/%s/%s.json', $locale, $project));
+      static::$projects[$locale][$project] = [
+        'strings' => [],
+        'segments' => [],
+      ];
       return false;
-    } else {
-      static::$projects[$locale][$project] =
-        json_decode(file_get_contents($project_path));
+    }
+
+    $key = sprintf('base:translations:%s:%s:%d', $locale, $project, $mtime);
+    $catalog = apc_fetch($key, $success);
+    if (!$success) {
+      $catalog = static::compile($locale, $project);
+      apc_store($key, $catalog);
+    }
+
+    static::$projects[$locale][$project] = $catalog;
+    return true;
+  }
+
+  // Loads every project of every locale. Returns the number of projects.
+  static public function preload(): int {
+    $projects = [];
+    foreach (glob('projects/*/*.{json,hh}', GLOB_BRACE) ?: [] as $path) {
+      $locale = basename(dirname($path));
+      $project = pathinfo($path, PATHINFO_FILENAME);
+      if (!isset($projects[$locale . '/' . $project])) {
+        $projects[$locale . '/' . $project] = true;
+        static::loadProject($locale, $project);
+      }
+    }
+    return count($projects);
+  }
+
+  // The JSON catalogs of $locale and its parent locales that exist, most
+  // specific first.
+  static public function sources(
+    string $locale,
+    string $project): array<string> {
+    $sources = [];
+    while ($locale !== '') {
+      $path = sprintf('projects/%s/%s.json', $locale, $project);
+      if (file_exists($path)) {
+        $sources[] = $path;
+      }
+      $locale = substr(
+        $locale,
+        0,
+        max((int)strrpos($locale, '-'), (int)strrpos($locale, '_')));
+    }
+    return $sources;
+  }
+
+  static public function compile(string $locale, string $project): array {
+    $strings = [];
+    foreach (static::sources($locale, $project) as $source) {
+      $catalog = json_decode(file_get_contents($source), true);
 
       invariant(
-        json_last_error() == JSON_ERROR_NONE,
-        'Failed parsing translation project: ', $project_path);
+        json_last_error() == JSON_ERROR_NONE && is_array($catalog),
+        'Failed parsing translation project: %s',
+        $source);
 
-      return true;
+      $strings += $catalog;
     }
+
+    $segments = [];
+    foreach ($strings as $key => $translation) {
+      $segments[$key] = static::split((string)$translation, $strings);
+    }
+
+    return ['strings' => $strings, 'segments' => $segments];
+  }
+
+  static protected function split(string $text, array $strings): array {
+    $segments = [];
+    $parts = preg_split(
+      '/(\{[^{}]+\})/',
+      $text,
+      -1,
+      PREG_SPLIT_DELIM_CAPTURE | PREG_SPLIT_NO_EMPTY);
+
+    foreach ($parts as $part) {
+      if ($part[0] === '{' && substr($part, -1) === '}') {
+        if (!isset($strings[$part])) {
+          $segments[] = [substr($part, 1, -1)];
+          continue;
+        }
+        $part = (string)$strings[$part];
+      }
+
+      $last = count($segments) - 1;
+      if ($last >= 0 && is_string($segments[$last])) {
+        $segments[$last] .= $part;
+      } else {
+        $segments[] = $part;
+      }
+    }
+
+    return $segments;
   }
 
   static public function translation(
@@ -1245,7 +2805,27 @@ class BaseTranslationHolder {
       static::loadProject($locale, $project);
     }
     $key = trim($key);
-    return idx(static::$projects[$locale][$project], $key, $key);
+    return isset(static::$projects[$locale][$project]['strings'][$key]) ?
+      static::$projects[$locale][$project]['strings'][$key] :
+      $key;
+  }
+
+  // Segments of the translation of $key. Keys with no translation are
+  // split on first use.
+  static public function segments(
+    string $locale,
+    string $project,
+    string $key): array {
+    if (!isset(static::$projects[$locale][$project])) {
+      static::loadProject($locale, $project);
+    }
+    $key = trim($key);
+    if (!isset(static::$projects[$locale][$project]['segments'][$key])) {
+      static::$projects[$locale][$project]['segments'][$key] = static::split(
+        $key,
+        static::$projects[$locale][$project]['strings']);
+    }
+    return static::$projects[$locale][$project]['segments'][$key];
   }
 }
 
@@ -1276,32 +2856,28 @@ class :t extends :x:primitive {
       if (is_string($elem)) {
         $key .= $elem;
       } else {
-        $token_key = sprintf('{%s}', $elem->getAttribute('name'));
-        $tokens[$token_key] = $elem->stringify();
-        $key .= $token_key;
+        $name = $elem->getAttribute('name');
+        $tokens[$name] = $elem->stringify();
+        $key .= '{' . $name . '}';
       }
     }
 
-    $translation = BaseTranslationHolder::translation(
+    $text = '';
+    $segments = BaseTranslationHolder::segments(
       $this->locale,
       $this->getAttribute('project'),
       $key);
-
-    foreach ($tokens as $token_key => &$token) {
-      $translated_token = BaseTranslationHolder::translation(
-        $this->locale,
-        $this->getAttribute('project'),
-        $token_key);
-
-      $token = $translated_token === $token_key ?
-        $token :
-        $translated_token;
+    foreach ($segments as $segment) {
+      if (is_string($segment)) {
+        $text .= $segment;
+      } else {
+        $text .= isset($tokens[$segment[0]]) ?
+          $tokens[$segment[0]] :
+          '{' . $segment[0] . '}';
+      }
     }
 
-    return str_replace(
-      array_keys($tokens),
-      array_values($tokens),
-      $translation);
+    return $text;
   }
 }
 
@@ -1320,16 +2896,38 @@ class :t:p extends :x:primitive {
   }
 }
 
+// Template files are read once per process and modification time. By
+// default variables are replaced one after the other, in the order they were
+// set, so a value may contain a placeholder set after it. singlePass()
+// instead compiles the template into segments, literal text and the
+// placeholders found in it, and renders them by concatenation without
+// rescanning values. Compiled templates are also kept in APC.
 class TemplateEngine {
+  const int ESCAPE_NONE = 0;
+  const int ESCAPE_HTML = 1;
+  const int ESCAPE_URL = 2;
+
+  protected static array<string, string> $templates = [];
+  protected static array<string, array> $compiled = [];
 
   protected StringToHTML $template;
+  protected string $templatePath;
+  protected string $templateKey;
   protected string $templateRaw;
+  protected bool $singlePass = false;
   protected string $css;
   protected Map $vars;
 
   public function __construct(string $template_name) {
     $this->vars = Map {};
-    $this->templateRaw = $this->getResource('templates/'.$template_name);
+    $this->templatePath = 'templates/'.$template_name;
+    $this->templateKey =
+      $this->templatePath . ':' . (int)@filemtime($this->templatePath);
+    if (!isset(self::$templates[$this->templateKey])) {
+      self::$templates[$this->templateKey] =
+        $this->getResource($this->templatePath);
+    }
+    $this->templateRaw = self::$templates[$this->templateKey];
   }
 
   protected function getResource(string $path): string {
@@ -1338,6 +2936,43 @@ class TemplateEngine {
     return $buffer;
   }
 
+  // Splits the template on $keys, longest first, so that a key that is a
+  // prefix of another one does not break it.
+  protected function compile(array<string> $keys): array {
+    usort($keys, function($a, $b) {
+      return strlen($b) - strlen($a) ?: strcmp($a, $b);
+    });
+
+    $signature = $this->templateKey . ':' . md5(implode("\0", $keys));
+    if (isset(self::$compiled[$signature])) {
+      return self::$compiled[$signature];
+    }
+
+    $apc_key = 'base:template:' . $signature;
+    $segments = apc_fetch($apc_key, $success);
+    if (!$success) {
+      $segments = [];
+      $placeholders = array_flip($keys);
+      $parts = $keys ?
+        preg_split(
+          '/(' . implode('|', array_map(
+            function($key) { return preg_quote($key, '/'); },
+            $keys)) . ')/',
+          self::$templates[$this->templateKey],
+          -1,
+          PREG_SPLIT_DELIM_CAPTURE | PREG_SPLIT_NO_EMPTY) :
+        [self::$templates[$this->templateKey]];
+
+      foreach ($parts as $part) {
+        $segments[] = isset($placeholders[$part]) ? [$part] : $part;
+      }
+      apc_store($apc_key, $segments);
+    }
+
+    self::$compiled[$signature] = $segments;
+    return $segments;
+  }
+
   public function loadCSS(mixed $css_path): this {
     invariant(
       is_string($css_path) || is_array($css_path),
@@ -1345,34 +2980,116 @@ class TemplateEngine {
 
     if (is_array($css_path)) {
       foreach ($css_path as $css) {
-        $this->css .= $this->getResource('public/'.$css);
+        $this->css .= BaseMinifier::file('css', 'public/'.$css);
       }
     } else if (is_string($css_path)) {
-      $this->css = $this->getResource('public/'.$css_path);
-    }
-    $this->css = preg_replace('!/\*[^*]*\*+([^/][^*]*\*+)*/!', '', $this->css);
-    $this->css = str_replace(': ', ':', $this->css);
-    $this->css = str_replace(
-      ["\r\n", "\r", "\n", "\t", '  ', '    ', '    '],
-      '',
-      $this->css);
+      $this->css = BaseMinifier::file('css', 'public/'.$css_path);
+    }
     return $this->css;
   }
 
-  public function setVar(string $key, mixed $value): this {
-    $this->vars->set($key, $value);
+  public static function escape(mixed $value, int $escape): string {
+    switch ($escape) {
+      case self::ESCAPE_HTML:
+        return htmlspecialchars((string)$value, ENT_QUOTES, 'UTF-8');
+      case self::ESCAPE_URL:
+        return rawurlencode((string)$value);
+      default:
+        return (string)$value;
+    }
+  }
+
+  public function setVar(
+    string $key,
+    mixed $value,
+    int $escape = self::ESCAPE_NONE): this {
+    if ($key !== '') {
+      $this->vars->set($key, self::escape($value, $escape));
+    }
     return $this;
   }
 
-  public function layout(bool $render_html = false): mixed {
-    $keys = [];
-    $values = [];
-    foreach ($this->vars as $key => $value) {
-      $keys[] = $key;
-      $values[] = $value;
+  public function singlePass(bool $enabled = true): this {
+    $this->singlePass = $enabled;
+    return $this;
+  }
+
+  protected function render(array<string, string> $vars): string {
+    if (!$this->singlePass) {
+      return str_replace(
+        array_keys($vars),
+        array_values($vars),
+        self::$templates[$this->templateKey]);
+    }
+
+    $rendered = '';
+    foreach ($this->compile(array_keys($vars)) as $segment) {
+      $rendered .= is_string($segment) ? $segment : $vars[$segment[0]];
+    }
+    return $rendered;
+  }
+
+  // Renders the template once per variable map, on top of the variables
+  // already set, yielding the outputs under the keys of $var_maps. The
+  // compiled template, and any CSS loaded into the variables, is shared by
+  // the whole batch. $escaping maps keys to their escaping policy.
+  public function batch(
+    Traversable<array<string, mixed>> $var_maps,
+    array<string, int> $escaping = []): Generator<mixed, string, void> {
+    $base = $this->vars->toArray();
+    foreach ($var_maps as $id => $var_map) {
+      $vars = $base;
+      foreach ($var_map as $key => $value) {
+        if ($key !== '') {
+          $vars[$key] = self::escape(
+            $value,
+            (int)idx($escaping, $key, self::ESCAPE_NONE));
+        }
+      }
+      yield $id => $this->render($vars);
+    }
+  }
+
+  // Splits $var_maps into chunks of $chunk_size and queues one
+  // $worker_class (a BaseTemplateBatchWorker) per chunk, to render them in
+  // parallel. Returns the number of workers queued.
+  public function batchInWorkers(
+    string $worker_class,
+    Traversable<array<string, mixed>> $var_maps,
+    array<string, int> $escaping = [],
+    int $chunk_size = 500): int {
+    invariant(
+      is_subclass_of($worker_class, 'BaseTemplateBatchWorker'),
+      '%s must be an instance of BaseTemplateBatchWorker',
+      $worker_class);
+
+    $payload = [
+      'template' => substr($this->templatePath, strlen('templates/')),
+      'vars' => $this->vars->toArray(),
+      'escaping' => $escaping,
+      'single_pass' => $this->singlePass,
+      'batch' => [],
+    ];
+
+    $queued = 0;
+    foreach ($var_maps as $id => $var_map) {
+      $payload['batch'][$id] = $var_map;
+      if (count($payload['batch']) >= $chunk_size) {
+        BaseWorkerScheduler::run(new $worker_class($payload));
+        $payload['batch'] = [];
+        $queued++;
+      }
     }
 
-    $this->templateRaw = str_replace($keys, $values, $this->templateRaw);
+    if ($payload['batch']) {
+      BaseWorkerScheduler::run(new $worker_class($payload));
+      $queued++;
+    }
+    return $queued;
+  }
+
+  public function layout(bool $render_html = false): mixed {
+    $this->templateRaw = $this->render($this->vars->toArray());
     $this->template = new StringToHTML($this->templateRaw);
     if ($render_html) {
       return $this->template;
@@ -1380,3 +3097,26 @@ class TemplateEngine {
     return $this->templateRaw;
   }
 }
+
+// Renders a chunk queued by TemplateEngine::batchInWorkers() and hands
+// each output to deliver().
+abstract class BaseTemplateBatchWorker extends BaseWorker {
+  abstract protected function deliver(
+    mixed $id,
+    array<string, mixed> $vars,
+    string $output): void;
+
+  final public function run(): void {
+    $engine = new TemplateEngine((string)$this->payload['template']);
+    $engine->singlePass((bool)idx($this->payload, 'single_pass'));
+    foreach ((array)$this->payload['vars'] as $key => $value) {
+      $engine->setVar((string)$key, $value);
+    }
+
+    $batch = (array)$this->payload['batch'];
+    $outputs = $engine->batch($batch, (array)$this->payload['escaping']);
+    foreach ($outputs as $id => $output) {
+      $this->deliver($id, $batch[$id], $output);
+    }
+  }
+}
@@ -0,0 +1,247 @@
+<?hh
+// Offline build steps. They are run from the application root through
+// build.hh, typically as part of a deploy:
+//
+//   hhvm vendor/base/base/src/build.hh classmap
+//   hhvm vendor/base/base/src/build.hh resources
+//   hhvm vendor/base/base/src/build.hh translations
+class BaseBuild {
+  protected static array<string, string> $commands = [
+    'classmap' => 'BaseClassmapBuilder',
+    'resources' => 'BaseResourceBundler',
+    'translations' => 'BaseTranslationCompiler',
+  ];
+
+  public static function run(array<string> $args): int {
+    $command = idx($args, 0);
+    if (!idx(self::$commands, $command)) {
+      fwrite(STDERR, sprintf(
+        'Usage: build.hh <%s>' . PHP_EOL,
+        implode('|', array_keys(self::$commands))));
+      return 1;
+    }
+
+    $builder = self::$commands[$command];
+    (new $builder())->build();
+    return 0;
+  }
+
+  // Written to a temporary file and renamed into place.
+  public static function writeArray(string $path, array $data): void {
+    $tmp = $path . '.' . getmypid() . '.tmp';
+    file_put_contents(
+      $tmp,
+      sprintf(
+        "<?hh\n// Generated by build.hh. Do not edit.\nreturn %s;\n",
+        var_export($data, true)));
+    rename($tmp, $path);
+  }
+
+  // .hh files under $dir, recursively.
+  public static function files(string $dir): array<string> {
+    if (!is_dir($dir)) {
+      return [];
+    }
+
+    $files = [];
+    $iterator = new RecursiveIteratorIterator(
+      new RecursiveDirectoryIterator($dir, FilesystemIterator::SKIP_DOTS));
+    foreach ($iterator as $file) {
+      if ($file->getExtension() === 'hh') {
+        $files[] = $file->getPathname();
+      }
+    }
+    sort($files);
+    return $files;
+  }
+}
+
+// Bundles the local stylesheets and scripts referenced by layouts and
+// widgets into public/bundles, one bundle per file and one per layout or
+// widget, and extracts each layout's /*! critical */ CSS.
+class BaseResourceBundler {
+  protected array<string> $sources = ['layouts', 'widgets'];
+  protected array<string, string> $contents = [];
+  protected array<string, array> $manifest = [
+    'bundles' => [],
+    'files' => [],
+    'critical' => [],
+  ];
+
+  public function build(): array<string, array> {
+    $dir = 'public/' . BaseLayoutHelper::BUNDLES_PATH;
+    if (!is_dir($dir)) {
+      mkdir($dir, 0755, true);
+    }
+
+    $sources = $this->scan();
+
+    foreach ($sources as $resources) {
+      foreach ($resources as $type => $files) {
+        if (count($files) > 1) {
+          $this->bundle($type, $files);
+        }
+      }
+    }
+
+    foreach ($sources as $resources) {
+      foreach ($resources as $type => $files) {
+        foreach ($files as $file) {
+          $this->bundle($type, [$file]);
+        }
+      }
+    }
+
+    foreach ($sources as $path => $resources) {
+      if (strpos($path, 'layouts/') === 0) {
+        $this->extractCriticalCSS(basename($path, '.hh'), $resources['css']);
+      }
+    }
+
+    BaseBuild::writeArray(
+      BaseConfig::getString('RESOURCES_MANIFEST') ?:
+        BaseLayoutHelper::MANIFEST,
+      $this->manifest);
+
+    ls('Built %d bundles', count($this->manifest['bundles']));
+    return $this->manifest;
+  }
+
+  protected function scan(): array<string, array<string, array<string>>> {
+    $sources = [];
+    foreach ($this->sources as $dir) {
+      foreach (BaseBuild::files($dir) as $path) {
+        $matches = regex_all(
+          '/[\'"]([^\'"\s?#]+\.(css|js))[\'"]/',
+          file_get_contents($path));
+
+        $found = ['css' => [], 'js' => []];
+        foreach ((array)idx($matches, 1, []) as $k => $url) {
+          if (BaseLayoutHelper::isLocal($url) && is_file('public/' . $url)) {
+            $found[$matches[2][$k]][$url] = $url;
+          }
+        }
+
+        $sources[$path] = [
+          'css' => array_values($found['css']),
+          'js' => array_values($found['js']),
+        ];
+      }
+    }
+    return $sources;
+  }
+
+  protected function bundle(string $type, array<string> $files): void {
+    $content = '';
+    foreach ($files as $file) {
+      if (!isset($this->contents[$file])) {
+        $this->contents[$file] =
+          BaseMinifier::minify($type, file_get_contents('public/' . $file));
+      }
+      // Scripts are separated by a semicolon in case one of them relies
+      // on automatic semicolon insertion at the end of the file.
+      $content .= $this->contents[$file] . ($type === 'js' ? ';' : '') .
+        PHP_EOL;
+    }
+
+    // The file list is part of the hash, so that two groups that happen to
+    // have the same content still get bundles of their own.
+    $name = sha256(implode(':', $files) . PHP_EOL . $content) . '.' . $type;
+    if (isset($this->manifest['bundles'][$name])) {
+      return;
+    }
+
+    $path = 'public/' . BaseLayoutHelper::BUNDLES_PATH . '/' . $name;
+    file_put_contents($path, $content);
+    BaseLayoutHelper::writeCompressed($path, $content);
+
+    $this->manifest['bundles'][$name] = $files;
+    foreach ($files as $file) {
+      $this->manifest['files'][$file][] = $name;
+    }
+  }
+
+  protected function extractCriticalCSS(
+    string $layout,
+    array<string> $files): void {
+    $critical = '';
+    foreach ($files as $file) {
+      $regions = regex_all(
+        '~/\*!\s*critical\s*\*/(.*?)/\*!\s*endcritical\s*\*/~s',
+        file_get_contents('public/' . $file));
+      foreach ((array)idx($regions, 1, []) as $region) {
+        $critical .= $region;
+      }
+    }
+
+    if (trim($critical) !== '') {
+      $this->manifest['critical'][$layout] =
+        BaseMinifier::minify('css', $critical);
+    }
+  }
+}
+
+// Compiles projects/<locale>/<project>.json into a .hh file next to it.
+class BaseTranslationCompiler {
+  public function build(): array<string> {
+    $compiled = [];
+    foreach (glob('projects/*/*.json') ?: [] as $source) {
+      $locale = basename(dirname($source));
+      $project = basename($source, '.json');
+      $path = sprintf('projects/%s/%s.hh', $locale, $project);
+      BaseBuild::writeArray(
+        $path,
+        BaseTranslationHolder::compile($locale, $project));
+      $compiled[] = $path;
+    }
+
+    ls('Compiled %d translation projects', count($compiled));
+    return $compiled;
+  }
+}
+
+// Scans the autoloaded directories for class, interface, trait and enum
+// declarations and writes the classmap the autoloader looks classes up
+// in. XHP classes are mapped under their runtime names, so :layout:home
+// is registered as xhp_layout__home.
+class BaseClassmapBuilder {
+  public function build(): array<string, string> {
+    $classmap = [];
+    foreach (Base::autoloadDirs() as $dir) {
+      foreach (BaseBuild::files($dir) as $path) {
+        $matches = regex_all(
+          '/^\s*(?:(?:abstract|final)\s+)*' .
+            '(?:class|interface|trait|enum)\s+(:[\w:-]+|\w+)/m',
+          file_get_contents($path));
+        foreach ((array)idx($matches, 1, []) as $class) {
+          $class = self::runtimeName($class);
+          invariant(
+            !isset($classmap[$class]) || $classmap[$class] === $path,
+            'Class %s is declared in both %s and %s',
+            $class,
+            $classmap[$class],
+            $path);
+          $classmap[$class] = $path;
+        }
+      }
+    }
+
+    ksort($classmap);
+    BaseBuild::writeArray(
+      BaseConfig::getString('CLASSMAP') ?: Base::CLASSMAP,
+      $classmap);
+
+    ls('Mapped %d classes', count($classmap));
+    return $classmap;
+  }
+
+  protected static function runtimeName(string $class): string {
+    if ($class[0] === ':') {
+      $class = 'xhp_' . str_replace(
+        [':', '-'],
+        ['__', '_'],
+        substr($class, 1));
+    }
+    return strtolower($class);
+  }
+}
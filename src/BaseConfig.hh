@@ -0,0 +1,109 @@
+<?hh
+// Snapshot of the environment, resolved once per process: the process
+// environment, the env/<SERVER_NAME>.json overrides outside prod, and the
+// values derived from them (the log file path, parsed service URLs). The
+// snapshot is kept in APC, keyed on the process environment and the env
+// file's mtime, so requests only pay for one fetch. It is read-only;
+// lookups are a single isset().
+final class BaseConfig {
+  protected static array<string, mixed> $values = [];
+  protected static array<string, array<string, mixed>> $urls = [];
+
+  // Service URLs parsed into the snapshot, see url().
+  protected static array<string> $urlKeys = ['MONGOHQ_URL', 'REDISCLOUD_URL'];
+
+  // Resolves the snapshot and exports it to $_ENV.
+  public static function load(): void {
+    $env_file = null;
+    if (array_key_exists('APPLICATION_ENV', $_ENV) &&
+      $_ENV['APPLICATION_ENV'] != 'prod') {
+      $env_file = 'env/' . idx($_SERVER, 'SERVER_NAME') . '.json';
+    }
+
+    $mtime = $env_file !== null ? (int)@filemtime($env_file) : 0;
+    $key = sprintf(
+      'base:config:%s:%s:%d',
+      md5(serialize($_ENV)),
+      (string)$env_file,
+      $mtime);
+    $snapshot = apc_fetch($key, $success);
+    if (!$success) {
+      $snapshot = self::resolve($mtime > 0 ? $env_file : null);
+      apc_store($key, $snapshot);
+    }
+
+    self::$values = $snapshot['values'];
+    self::$urls = $snapshot['urls'];
+    $_ENV = self::$values;
+  }
+
+  protected static function resolve(?string $env_file): array<string, array> {
+    $values = $_ENV;
+    if ($env_file !== null) {
+      $vars = json_decode(file_get_contents($env_file), true);
+      if (json_last_error() == JSON_ERROR_NONE && is_array($vars)) {
+        foreach ($vars as $key => $value) {
+          $values[$key] = $value;
+        }
+      }
+    }
+
+    if (!array_key_exists('BASE_LOG_FILE', $values)) {
+      $values['BASE_LOG_FILE'] = 'php://stderr';
+    }
+
+    $values['BASE_LOG_FILE'] = str_replace(
+      '{{PORT}}',
+      (string)idx($values, 'PORT', ''),
+      $values['BASE_LOG_FILE']);
+
+    $urls = [];
+    foreach (self::$urlKeys as $url_key) {
+      if (idx($values, $url_key)) {
+        $parts = parse_url($values[$url_key]) ?: [];
+        $url = $values[$url_key];
+        if (idx($parts, 'user') && idx($parts, 'pass')) {
+          $url = str_replace(
+            sprintf('%s:%s@', $parts['user'], $parts['pass']),
+            '',
+            $url);
+        }
+        // The URL without credentials.
+        $parts['url'] = $url;
+        $urls[$url_key] = $parts;
+      }
+    }
+
+    return ['values' => $values, 'urls' => $urls];
+  }
+
+  public static function get(string $key, mixed $default = null): mixed {
+    return isset(self::$values[$key]) ? self::$values[$key] : $default;
+  }
+
+  public static function getString(string $key, string $default = ''): string {
+    return isset(self::$values[$key]) ? (string)self::$values[$key] : $default;
+  }
+
+  public static function getInt(string $key, int $default = 0): int {
+    return isset(self::$values[$key]) ? (int)self::$values[$key] : $default;
+  }
+
+  public static function getBool(string $key): bool {
+    return isset(self::$values[$key]) && (bool)self::$values[$key];
+  }
+
+  public static function has(string $key): bool {
+    return isset(self::$values[$key]);
+  }
+
+  public static function all(): array<string, mixed> {
+    return self::$values;
+  }
+
+  // parse_url() of a service URL, plus 'url', the URL without its
+  // credentials. Null when the URL is not set.
+  public static function url(string $key): ?array<string, mixed> {
+    return isset(self::$urls[$key]) ? self::$urls[$key] : null;
+  }
+}
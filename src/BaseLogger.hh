@@ -0,0 +1,176 @@
+<?hh
+// Process-level log sink. The log file is opened once and kept open, and
+// lines are buffered in memory until BASE_LOG_BUFFER_SIZE bytes have been
+// collected or the request ends. HHVM closes resources at the end of each
+// request, so in server mode "once" means once per request rather than
+// once per log line; long-running workers keep the same handle.
+//
+// With BASE_LOG_FORMAT=json every event is written as one JSON object per
+// line. BASE_LOG_SAMPLE_<LEVEL> (0 to 1) keeps only a fraction of the
+// events of that level.
+class BaseLogger {
+  const int DEBUG = 0;
+  const int INFO = 1;
+  const int WARNING = 2;
+  const int ERROR = 3;
+
+  protected static array<int, string> $levelNames = [
+    self::DEBUG => 'debug',
+    self::INFO => 'info',
+    self::WARNING => 'warning',
+    self::ERROR => 'error',
+  ];
+
+  protected static $handle = null;
+  protected static string $buffer = '';
+  protected static ?int $level = null;
+  protected static array<int, float> $sampling = [];
+  protected static bool $json = false;
+  protected static bool $backtrace = true;
+  protected static ?string $requestId = null;
+  protected static int $bufferSize = 0;
+  protected static bool $flushRegistered = false;
+
+  protected static function configure(): void {
+    self::$level = self::DEBUG;
+    $level = strtolower(BaseConfig::getString('BASE_LOG_LEVEL', 'debug'));
+    foreach (self::$levelNames as $value => $name) {
+      if ($name === $level) {
+        self::$level = $value;
+      }
+
+      self::$sampling[$value] =
+        (float)BaseConfig::get('BASE_LOG_SAMPLE_' . strtoupper($name), 1);
+    }
+
+    self::$json = BaseConfig::get('BASE_LOG_FORMAT') === 'json';
+    self::$backtrace = (bool)BaseConfig::get('BASE_LOG_BACKTRACE', true);
+    self::$bufferSize = BaseConfig::getInt('BASE_LOG_BUFFER_SIZE');
+  }
+
+  // Decides whether an event of the given level is going to be written,
+  // sampling included. Call sites check this before doing any work to
+  // build the message or capture a backtrace.
+  public static function enabled(int $level): bool {
+    if (self::$level === null) {
+      self::configure();
+    }
+
+    if ($level < self::$level) {
+      return false;
+    }
+
+    $rate = self::$sampling[$level];
+    return $rate >= 1 || ($rate > 0 && mt_rand() / mt_getrandmax() < $rate);
+  }
+
+  // Level threshold only, without sampling.
+  public static function meetsLevel(int $level): bool {
+    if (self::$level === null) {
+      self::configure();
+    }
+    return $level >= self::$level;
+  }
+
+  public static function isJSON(): bool {
+    if (self::$level === null) {
+      self::configure();
+    }
+    return self::$json;
+  }
+
+  public static function captureBacktrace(): bool {
+    if (self::$level === null) {
+      self::configure();
+    }
+    return self::$backtrace;
+  }
+
+  public static function requestId(): string {
+    if (self::$requestId === null) {
+      self::$requestId = idx(
+        $_SERVER,
+        'HTTP_X_REQUEST_ID',
+        substr(sha256(uniqid('', true)), 0, 16));
+    }
+    return self::$requestId;
+  }
+
+  public static function format(
+    int $level,
+    string $message,
+    ?string $file,
+    ?int $line,
+    array $fields = []): string {
+    if (self::$level === null) {
+      self::configure();
+    }
+
+    $text = sprintf('[%s:%d] %s', $file, $line, $message);
+    if (!self::$json) {
+      return $text;
+    }
+
+    $now = microtime(true);
+    $event = [
+      'timestamp' => gmdate('Y-m-d\TH:i:s', (int)$now) .
+        sprintf('.%06dZ', (int)(fmod($now, 1) * 1000000)),
+      'level' => self::$levelNames[$level],
+      'request_id' => self::requestId(),
+      'route' => ApiRunner::currentRoute(),
+      'file' => $file,
+      'line' => $line,
+      'message' => rtrim($message, PHP_EOL),
+    ];
+
+    if ($fields) {
+      $event['fields'] = $fields;
+    }
+
+    $json = json_encode($event, JSON_PARTIAL_OUTPUT_ON_ERROR);
+    return $json !== false ? $json . PHP_EOL : $text;
+  }
+
+  public static function write(string $log): void {
+    self::$buffer .= $log;
+    if (strlen(self::$buffer) >= self::$bufferSize) {
+      self::flush();
+      return;
+    }
+
+    if (!self::$flushRegistered) {
+      self::$flushRegistered = true;
+      // With BASE_LOG_ASYNC_FLUSH the buffer is written after the response
+      // has been sent to the client.
+      if (BaseConfig::getBool('BASE_LOG_ASYNC_FLUSH') &&
+        function_exists('register_postsend_function')) {
+        register_postsend_function(['BaseLogger', 'flushRegistered']);
+      } else {
+        register_shutdown_function(['BaseLogger', 'flushRegistered']);
+      }
+    }
+  }
+
+  // Lines written by shutdown functions that run after this one register
+  // it again.
+  public static function flushRegistered(): void {
+    self::$flushRegistered = false;
+    self::flush();
+  }
+
+  public static function flush(): void {
+    if (self::$buffer === '') {
+      return;
+    }
+
+    if (!self::$handle) {
+      self::$handle = fopen(BaseConfig::getString('BASE_LOG_FILE'), 'a');
+      if (!self::$handle) {
+        return;
+      }
+    }
+
+    fwrite(self::$handle, self::$buffer);
+    self::$buffer = '';
+  }
+}
@@ -0,0 +1,318 @@
+<?hh
+// Tokenizer-based CSS and JS minification. Strings, regular expression
+// literals and template literals are copied verbatim; comments are
+// dropped and whitespace is only kept where removing it would change the
+// meaning of the code.
+//
+// Results are cached in APC by content hash, and file results are also
+// memoized by path, mtime and size, so repeated calls cost a stat.
+class BaseMinifier {
+  const int CACHE_TTL = 86400;
+
+  protected static array<string, string> $files = [];
+
+  public static function file(string $type, string $path): string {
+    $stat = @stat($path);
+    invariant($stat !== false, 'Invalid resource %s', $path);
+
+    $key = sprintf('%s:%s:%d:%d', $type, $path, $stat['mtime'], $stat['size']);
+    if (!isset(self::$files[$key])) {
+      self::$files[$key] = self::minify($type, file_get_contents($path));
+    }
+    return self::$files[$key];
+  }
+
+  public static function minify(string $type, string $content): string {
+    $key = sprintf('base:min:%s:%s', $type, sha1($content));
+    $success = false;
+    $minified = apc_fetch($key, $success);
+    if ($success) {
+      return $minified;
+    }
+
+    switch ($type) {
+      case 'css':
+        $minified = self::css($content);
+        break;
+      case 'js':
+        $minified = self::js($content);
+        break;
+      default:
+        $minified = $content;
+    }
+
+    apc_store($key, $minified, self::CACHE_TTL);
+    return $minified;
+  }
+
+  public static function css(string $css): string {
+    $out = '';
+    $length = strlen($css);
+    $parens = 0;
+    $i = 0;
+
+    while ($i < $length) {
+      $c = $css[$i];
+
+      if ($c === '"' || $c === "'") {
+        $end = self::skipString($css, $i, $c);
+        $out .= substr($css, $i, $end - $i);
+        $i = $end;
+        continue;
+      }
+
+      // A comment separates tokens like whitespace does.
+      if (ctype_space($c) || self::startsComment($css, $i, '*')) {
+        while ($i < $length) {
+          if (ctype_space($css[$i])) {
+            $i++;
+          } elseif (self::startsComment($css, $i, '*')) {
+            $end = strpos($css, '*/', $i + 2);
+            $i = $end === false ? $length : $end + 2;
+          } else {
+            break;
+          }
+        }
+
+        $prev = $out === '' ? '' : $out[strlen($out) - 1];
+        $next = $i < $length ? $css[$i] : '';
+        if ($prev === '' || $next === '' ||
+          strpos('{};,>~(:', $prev) !== false ||
+          strpos('{};,>~)', $next) !== false ||
+          // '+' is a combinator outside parentheses but an operator in
+          // calc(), where it needs surrounding whitespace.
+          ($parens === 0 && ($prev === '+' || $next === '+'))) {
+          continue;
+        }
+
+        $out .= ' ';
+        continue;
+      }
+
+      if ($c === '(') {
+        $parens++;
+      } elseif ($c === ')' && $parens > 0) {
+        $parens--;
+      } elseif ($c === '}' && $out !== '' && $out[strlen($out) - 1] === ';') {
+        $out = substr($out, 0, -1);
+      }
+
+      $out .= $c;
+      $i++;
+    }
+
+    return $out;
+  }
+
+  public static function js(string $js): string {
+    $out = '';
+    $length = strlen($js);
+    $i = 0;
+
+    while ($i < $length) {
+      $c = $js[$i];
+
+      if ($c === '"' || $c === "'" || $c === '`') {
+        $end = $c === '`' ?
+          self::skipTemplate($js, $i) :
+          self::skipString($js, $i, $c);
+        $out .= substr($js, $i, $end - $i);
+        $i = $end;
+        continue;
+      }
+
+      // Comments stand for the whitespace around them, a newline if they
+      // span one.
+      if (ctype_space($c) ||
+        self::startsComment($js, $i, '/') ||
+        self::startsComment($js, $i, '*')) {
+        $newline = false;
+        while ($i < $length) {
+          $c = $js[$i];
+          if (ctype_space($c)) {
+            $newline = $newline || $c === "\n" || $c === "\r";
+            $i++;
+          } elseif (self::startsComment($js, $i, '/')) {
+            // Stop at the newline, it may terminate a statement.
+            $end = strpos($js, "\n", $i);
+            $i = $end === false ? $length : $end;
+          } elseif (self::startsComment($js, $i, '*')) {
+            $end = strpos($js, '*/', $i + 2);
+            $end = $end === false ? $length : $end + 2;
+            $newline = $newline || substr_count($js, "\n", $i, $end - $i) > 0;
+            $i = $end;
+          } else {
+            break;
+          }
+        }
+
+        $prev = $out === '' ? '' : $out[strlen($out) - 1];
+        $next = $i < $length ? $js[$i] : '';
+        if ($prev === '' || $next === '') {
+          continue;
+        }
+
+        if (self::isIdentifierChar($prev) && self::isIdentifierChar($next)) {
+          $out .= $newline ? "\n" : ' ';
+        } elseif ($newline &&
+          (self::isIdentifierChar($prev) ||
+            strpos(')]}+-"\'`', $prev) !== false) &&
+          (self::isIdentifierChar($next) ||
+            strpos('([{+-!~"\'`', $next) !== false)) {
+          // Automatic semicolon insertion may depend on this newline.
+          $out .= "\n";
+        } elseif (($prev === '+' || $prev === '-') && $prev === $next) {
+          // a + +b, a - -b
+          $out .= ' ';
+        }
+        continue;
+      }
+
+      if ($c === '/' && self::regexAllowed($out)) {
+        $end = self::skipRegex($js, $i);
+        $out .= substr($js, $i, $end - $i);
+        $i = $end;
+        continue;
+      }
+
+      $out .= $c;
+      $i++;
+    }
+
+    return $out;
+  }
+
+  // Whether a comment starts at $i: '/*' when $second is '*', '//' when
+  // it is '/'.
+  protected static function startsComment(
+    string $source,
+    int $i,
+    string $second): bool {
+    return $source[$i] === '/' &&
+      $i + 1 < strlen($source) &&
+      $source[$i + 1] === $second;
+  }
+
+  protected static function isIdentifierChar(string $c): bool {
+    return ctype_alnum($c) || $c === '_' || $c === '$' || $c === '\\' ||
+      ord($c) > 126;
+  }
+
+  // Returns the offset right after the string starting at $start.
+  protected static function skipString(
+    string $source,
+    int $start,
+    string $quote): int {
+    $length = strlen($source);
+    $i = $start + 1;
+    while ($i < $length) {
+      if ($source[$i] === '\\') {
+        $i += 2;
+        continue;
+      }
+      if ($source[$i] === $quote) {
+        return $i + 1;
+      }
+      $i++;
+    }
+    return $length;
+  }
+
+  // Returns the offset right after the template literal starting at
+  // $start, including any nested templates in its ${} substitutions.
+  protected static function skipTemplate(string $source, int $start): int {
+    $length = strlen($source);
+    $i = $start + 1;
+    while ($i < $length) {
+      $c = $source[$i];
+      if ($c === '\\') {
+        $i += 2;
+        continue;
+      }
+      if ($c === '`') {
+        return $i + 1;
+      }
+      if ($c === '$' && $i + 1 < $length && $source[$i + 1] === '{') {
+        $i = self::skipSubstitution($source, $i + 2);
+        continue;
+      }
+      $i++;
+    }
+    return $length;
+  }
+
+  protected static function skipSubstitution(string $source, int $i): int {
+    $length = strlen($source);
+    $depth = 1;
+    while ($i < $length) {
+      $c = $source[$i];
+      if ($c === '"' || $c === "'") {
+        $i = self::skipString($source, $i, $c);
+        continue;
+      }
+      if ($c === '`') {
+        $i = self::skipTemplate($source, $i);
+        continue;
+      }
+      if ($c === '{') {
+        $depth++;
+      } elseif ($c === '}' && --$depth === 0) {
+        return $i + 1;
+      }
+      $i++;
+    }
+    return $length;
+  }
+
+  // A slash starts a regular expression literal when it cannot be a
+  // division, i.e. after an operator, an opening bracket or a keyword.
+  // Only the end of the output is inspected: the minifier never leaves
+  // more than one whitespace character there, and the longest keyword is
+  // ten bytes.
+  protected static function regexAllowed(string $out): bool {
+    $end = strlen($out) - 1;
+    while ($end >= 0 && ctype_space($out[$end])) {
+      $end--;
+    }
+    if ($end < 0) {
+      return true;
+    }
+
+    if (strpos('(,=:[!&|?{};~+-*%<>^', $out[$end]) !== false) {
+      return true;
+    }
+
+    $start = max(0, $end - 10);
+    return preg_match(
+      '/(?:^|[^\w$])(return|typeof|instanceof|in|of|new|delete|void|throw|' .
+      'case|do|else|yield|await)$/',
+      substr($out, $start, $end - $start + 1)) === 1;
+  }
+
+  protected static function skipRegex(string $source, int $start): int {
+    $length = strlen($source);
+    $in_class = false;
+    $i = $start + 1;
+    while ($i < $length) {
+      $c = $source[$i];
+      if ($c === '\\') {
+        $i += 2;
+        continue;
+      }
+      if ($c === "\n") {
+        // Not a regular expression after all; treat the slash as an
+        // operator.
+        return $start + 1;
+      }
+      if ($c === '[') {
+        $in_class = true;
+      } elseif ($c === ']') {
+        $in_class = false;
+      } elseif ($c === '/' && !$in_class) {
+        return $i + 1;
+      }
+      $i++;
+    }
+    return $start + 1;
+  }
+}
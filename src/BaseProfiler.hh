@@ -0,0 +1,102 @@
+<?hh
+// Request-scoped timers. Spans with the same name are aggregated, so
+// 'db' reports the total time and number of queries of the request.
+//
+// BASE_PROFILER lists where the results go: 'header' sends them as a
+// Server-Timing header right before the response body, 'log' writes one
+// log line at the end of the request. When it is empty, start() and
+// stop() only check a static flag.
+class BaseProfiler {
+  protected static ?bool $enabled = null;
+  protected static bool $header = false;
+  protected static float $requestStart = 0.0;
+  protected static array<string, array<int, mixed>> $spans = [];
+
+  public static function enabled(): bool {
+    if (self::$enabled === null) {
+      $outputs = array_map(
+        'trim',
+        explode(',', BaseConfig::getString('BASE_PROFILER')));
+      self::$header = in_array('header', $outputs);
+      self::$enabled = self::$header || in_array('log', $outputs);
+      self::$requestStart = (float)idx(
+        $_SERVER,
+        'REQUEST_TIME_FLOAT',
+        microtime(true));
+
+      if (in_array('log', $outputs)) {
+        register_shutdown_function(['BaseProfiler', 'log']);
+      }
+    }
+    return self::$enabled;
+  }
+
+  // Returns a start mark to be passed to stop(), or 0 when disabled.
+  public static function start(): float {
+    return self::enabled() ? microtime(true) : 0.0;
+  }
+
+  public static function stop(string $name, float $start): void {
+    if ($start > 0) {
+      self::record($name, (microtime(true) - $start) * 1000);
+    }
+  }
+
+  public static function record(string $name, float $ms): void {
+    if (!self::enabled()) {
+      return;
+    }
+
+    if (!isset(self::$spans[$name])) {
+      self::$spans[$name] = [0.0, 0];
+    }
+    self::$spans[$name][0] += $ms;
+    self::$spans[$name][1]++;
+  }
+
+  public static function spans(): array<string, array<int, mixed>> {
+    $spans = self::$spans;
+    $spans['total'] = [(microtime(true) - self::$requestStart) * 1000, 1];
+    return $spans;
+  }
+
+  public static function serverTiming(): string {
+    $metrics = [];
+    foreach (self::spans() as $name => $span) {
+      $metrics[] = sprintf(
+        '%s;%sdur=%.2f',
+        preg_replace('/[^\w-]/', '-', $name),
+        $span[1] > 1 ? sprintf('desc="x%d";', $span[1]) : '',
+        $span[0]);
+    }
+    return implode(', ', $metrics);
+  }
+
+  // Called right before the body is written, while headers can still be
+  // sent.
+  public static function sendHeader(): void {
+    if (!self::enabled() || !self::$header || headers_sent()) {
+      return;
+    }
+    header('Server-Timing: ' . self::serverTiming());
+  }
+
+  public static function log(): void {
+    $fields = [];
+    $timings = [];
+    foreach (self::spans() as $name => $span) {
+      $fields[$name] = ['ms' => round($span[0], 2), 'count' => $span[1]];
+      $timings[] = sprintf('%s=%.2fms', $name, $span[0]);
+    }
+
+    logger(
+      sprintf(
+        'Profile %s: %s' . PHP_EOL,
+        ApiRunner::currentRoute() ?: idx($_SERVER, 'REQUEST_URI', 'cli'),
+        implode(' ', $timings)),
+      null,
+      null,
+      BaseLogger::INFO,
+      $fields);
+  }
+}
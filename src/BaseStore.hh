@@ -1,8 +1,112 @@
 <?hh
+// Per-request accounting of store operations. Every query is timed and
+// counted; queries slower than MONGO_SLOW_QUERY_MS are logged with their
+// shape (the query with all values replaced by '?') and collection, and
+// MONGO_QUERY_SUMMARY=1 logs the request totals at shutdown.
+class BaseQueryLog {
+  protected static int $queries = 0;
+  protected static float $time = 0.0;
+  protected static int $hydrated = 0;
+  protected static ?float $slowThreshold = null;
+
+  public static function record(
+    string $collection,
+    string $operation,
+    mixed $query,
+    float $start): void {
+    $ms = (microtime(true) - $start) * 1000;
+
+    if (self::$slowThreshold === null) {
+      self::$slowThreshold = (float)BaseConfig::get('MONGO_SLOW_QUERY_MS', 0);
+      if (BaseConfig::getBool('MONGO_QUERY_SUMMARY')) {
+        register_shutdown_function(['BaseQueryLog', 'summary']);
+      }
+    }
+
+    self::$queries++;
+    self::$time += $ms;
+    BaseProfiler::record('db', $ms);
+
+    if (self::$slowThreshold > 0 &&
+      $ms >= self::$slowThreshold &&
+      BaseLogger::enabled(BaseLogger::WARNING)) {
+      $shape = json_encode(self::shape($query));
+      logger(
+        sprintf(
+          'Slow query: %s.%s %s (%.2fms)' . PHP_EOL,
+          $collection,
+          $operation,
+          $shape,
+          $ms),
+        null,
+        null,
+        BaseLogger::WARNING,
+        [
+          'collection' => $collection,
+          'operation' => $operation,
+          'shape' => $shape,
+          'ms' => round($ms, 2),
+        ]);
+    }
+  }
+
+  public static function hydrated(int $count = 1): void {
+    self::$hydrated += $count;
+  }
+
+  public static function stats(): array<string, mixed> {
+    return [
+      'queries' => self::$queries,
+      'ms' => round(self::$time, 2),
+      'hydrated' => self::$hydrated,
+    ];
+  }
+
+  // Keeps field names and operators, replaces values with '?'. Lists are
+  // reduced to their distinct element shapes, so that {$in: [1, 2, 3]}
+  // and {$in: [4]} normalize to the same shape.
+  public static function shape(mixed $query): mixed {
+    if (!is_array($query)) {
+      return '?';
+    }
+
+    if ($query && array_keys($query) === range(0, count($query) - 1)) {
+      $shapes = [];
+      foreach ($query as $value) {
+        $shape = self::shape($value);
+        $shapes[serialize($shape)] = $shape;
+      }
+      return array_values($shapes);
+    }
+
+    $shape = [];
+    foreach ($query as $key => $value) {
+      $shape[$key] = self::shape($value);
+    }
+    return $shape;
+  }
+
+  public static function summary(): void {
+    $stats = self::stats();
+    logger(
+      sprintf(
+        'Queries %s: %d queries, %.2fms, %d documents hydrated' . PHP_EOL,
+        ApiRunner::currentRoute() ?: idx($_SERVER, 'REQUEST_URI', 'cli'),
+        $stats['queries'],
+        $stats['ms'],
+        $stats['hydrated']),
+      null,
+      null,
+      BaseLogger::INFO,
+      $stats);
+  }
+}
+
 abstract class BaseStore {
 
   protected $class;
   protected $db;
+  protected $query;
 
   protected static $instance;
 
@@ -32,6 +136,7 @@ abstract class BaseStore {
 
   public function find(?array $query = [], ?array $fields = []) {
     $i = static::i();
+    $i->query = $query;
     $i->docs = $i->db->find($query, $fields);
     return $i;
   }
@@ -39,7 +144,9 @@ abstract class BaseStore {
   public function findOne(?array $query = [], ?array $fields = []) {
     $i = static::i();
     $class = $i->class;
+    $t = microtime(true);
     $doc = $i->db->findOne($query, $fields);
+    BaseQueryLog::record($i->collection, 'findOne', $query, $t);
     return $i->loadModel($doc);
   }
 
@@ -49,7 +156,10 @@ abstract class BaseStore {
     ?array $options = []
   ) {
     $i = static::i();
-    return $i->db->update($query, $new_object, $options);
+    $t = microtime(true);
+    $result = $i->db->update($query, $new_object, $options);
+    BaseQueryLog::record($i->collection, 'update', $query, $t);
+    return $result;
   }
 
   public function sort(array $query)  {
@@ -67,10 +177,18 @@ abstract class BaseStore {
     return $this;
   }
 
+  // The query runs when the cursor is rewound, which is what gets timed.
+  // Further batches are fetched lazily while iterating.
   public function load() {
     $class = $this->class;
-    foreach ($this->docs as $doc) {
-      yield new $class($doc);
+    $t = microtime(true);
+    $this->docs->rewind();
+    BaseQueryLog::record($this->collection, 'find', $this->query, $t);
+
+    while ($this->docs->valid()) {
+      BaseQueryLog::hydrated();
+      yield new $class($this->docs->current());
+      $this->docs->next();
     }
   }
 
@@ -79,11 +197,15 @@ abstract class BaseStore {
       return null;
     }
     $class = $this->class;
+    BaseQueryLog::hydrated();
     return new $class($doc);
   }
 
   public function distinct(string $key, array $query = []) {
-    $docs = static::i()->db->distinct($key, $query);
+    $i = static::i();
+    $t = microtime(true);
+    $docs = $i->db->distinct($key, $query);
+    BaseQueryLog::record($i->collection, 'distinct', $query, $t);
     return !is_array($docs) ? [] : $docs;
   }
 
@@ -92,7 +214,11 @@ abstract class BaseStore {
   }
 
   public function count(array $query = []): int {
-    return static::i()->db->count($query);
+    $i = static::i();
+    $t = microtime(true);
+    $count = $i->db->count($query);
+    BaseQueryLog::record($i->collection, 'count', $query, $t);
+    return $count;
   }
 
   protected function ensureType(BaseModel $item): bool {
@@ -138,9 +264,17 @@ abstract class BaseStore {
   }
 
   public function aggregate(BaseAggregation $aggregation) {
-    return call_user_func_array(
-      [static::i()->db, 'aggregate'],
+    $i = static::i();
+    $t = microtime(true);
+    $result = call_user_func_array(
+      [$i->db, 'aggregate'],
       $aggregation->getPipeline());
+    BaseQueryLog::record(
+      $i->collection,
+      'aggregate',
+      $aggregation->getPipeline(),
+      $t);
+    return $result;
   }
 
   public function mapReduce(
@@ -232,6 +366,7 @@ class BaseStoreCursor {
   public function docs() {
     $class = $this->class;
     foreach ($this->cursor as $entry) {
+      BaseQueryLog::hydrated();
       yield new $class($entry);
     }
   }
@@ -410,6 +545,141 @@ abstract class BaseModel {
   final public function reference(): BaseRef {
     return BaseRef::fromModel($this);
   }
+
+  // Fields emitted by toJSON(), as property => JSON key. Empty means every
+  // public property under its own name.
+  public static function jsonFields(): array<string, string> {
+    return [];
+  }
+
+  // How many levels of BaseRef fields toJSON() expands into the referenced
+  // document; deeper references are emitted as their id.
+  public static function jsonRefDepth(): int {
+    return 0;
+  }
+
+  public function toJSON(): string {
+    return BaseModelSerializer::json($this);
+  }
+}
+
+// Writes models straight to JSON following their jsonFields() and
+// jsonRefDepth(), without building document() arrays first. MongoIds are
+// emitted as strings and MongoDates as seconds. The field plan of each
+// class is compiled once and cached in APC.
+class BaseModelSerializer {
+  protected static array<string, array<string, string>> $plans = [];
+
+  public static function json(BaseModel $model, ?int $depth = null): string {
+    $plan = self::plan(get_class($model));
+    $depth = $depth === null ? $model::jsonRefDepth() : $depth;
+
+    $json = '';
+    foreach ($plan as $property => $key) {
+      $json .= ($json === '' ? '' : ',') .
+        $key . self::encode($model->$property, $depth);
+    }
+    return '{' . $json . '}';
+  }
+
+  // Models nested in $value use their own jsonRefDepth() unless $depth
+  // is given.
+  public static function encode(mixed $value, ?int $depth = null): string {
+    if ($value instanceof BaseModel) {
+      return self::json($value, $depth);
+    }
+
+    if ($value instanceof BaseRef) {
+      $model = $depth > 0 ? $value->model() : null;
+      return $model !== null ?
+        self::json($model, $depth - 1) :
+        self::scalar((string)$value->id());
+    }
+
+    if ($value instanceof MongoId) {
+      return self::scalar((string)$value);
+    }
+
+    if ($value instanceof MongoDate) {
+      return (string)$value->sec;
+    }
+
+    if (!is_array($value)) {
+      return self::scalar($value);
+    }
+
+    if (!$value) {
+      return '[]';
+    }
+
+    $items = [];
+    if (array_keys($value) === range(0, count($value) - 1)) {
+      foreach ($value as $item) {
+        $items[] = self::encode($item, $depth);
+      }
+      return '[' . implode(',', $items) . ']';
+    }
+
+    foreach ($value as $key => $item) {
+      $items[] =
+        self::scalar((string)$key) . ':' . self::encode($item, $depth);
+    }
+    return '{' . implode(',', $items) . '}';
+  }
+
+  protected static function scalar(mixed $value): string {
+    $json = json_encode($value);
+    invariant(
+      $json !== false,
+      'Cannot serialize value to JSON: %s',
+      json_last_error_msg());
+    return $json;
+  }
+
+  // Maps each serialized property to its pre-encoded '"key":' prefix. The
+  // APC copy is keyed by the mtime of the files declaring the class and
+  // its parents, so it is rebuilt when any of them changes.
+  protected static function plan(string $class): array<string, string> {
+    if (isset(self::$plans[$class])) {
+      return self::$plans[$class];
+    }
+
+    $mtime = 0;
+    $reflection = new ReflectionClass($class);
+    for ($c = $reflection; $c; $c = $c->getParentClass()) {
+      if ($c->getFileName()) {
+        $mtime = max($mtime, (int)@filemtime($c->getFileName()));
+      }
+    }
+
+    $apc_key = sprintf('base:json:%s:%d', $class, $mtime);
+    $plan = apc_fetch($apc_key, $success);
+    if (!$success) {
+      $fields = $class::jsonFields();
+      if (!$fields) {
+        foreach ($reflection->getProperties(ReflectionProperty::IS_PUBLIC)
+          as $property) {
+          if (!$property->isStatic()) {
+            $fields[$property->getName()] = $property->getName();
+          }
+        }
+      }
+
+      $plan = [];
+      foreach ($fields as $property => $key) {
+        invariant(
+          property_exists($class, $property),
+          'Cannot serialize field %s in %s: field does not exist',
+          $property,
+          $class);
+        $plan[$property] = self::scalar($key) . ':';
+      }
+      apc_store($apc_key, $plan);
+    }
+
+    self::$plans[$class] = $plan;
+    return $plan;
+  }
 }
 
 class BaseRef<T as BaseModel> {
@@ -447,18 +717,29 @@ class BaseRef<T as BaseModel> {
     return new self<T>($model);
   }
 
+  public function id(): MongoId {
+    return $this->_id;
+  }
+
   public function model(): ?T {
     if ($this->model) {
       return $this->model;
     }
 
     $store = MongoInstance::get($this->__collection);
+    $t = microtime(true);
     $doc = $store->findOne(['_id' => $this->_id]);
+    BaseQueryLog::record(
+      $this->__collection,
+      'findOne',
+      ['_id' => $this->_id],
+      $t);
     if ($doc === null) {
       ls('Broken reference: %s:%s', $this->__collection, $this->_id);
       return null;
     }
 
+    BaseQueryLog::hydrated();
     $model = $this->__model;
     $this->model = new $model($doc);
     return $this->model;
@@ -0,0 +1,73 @@
+<?hh
+// Does the work the first requests after a deploy would otherwise pay
+// for: loads every controller and classmapped class into the bytecode
+// cache, compiles the routes, opens the Mongo and Redis connections, loads
+// the translation catalogs and the bundle manifest. Bundles are built by
+// build.hh resources, never here. Once it succeeds, isWarm() is true for
+// the lifetime of the instance's APC cache, so health checks can hold the
+// instance out of rotation until then.
+class BaseWarmup {
+  const string WARM_KEY = 'base:warm';
+
+  public static function isWarm(): bool {
+    return (bool)apc_fetch(self::WARM_KEY);
+  }
+
+  public static function run(): array<string, mixed> {
+    $t = microtime(true);
+    $stats = [
+      'controllers' => self::controllers(),
+      'routes' => count((new ApiRunner(ApiRunner::getMap()))->compileRoutes()),
+      'classes' => self::classes(),
+      'connections' => self::connections(),
+      'translations' => BaseTranslationHolder::preload(),
+      'bundles' => self::bundles(),
+    ];
+    $stats['ms'] = round((microtime(true) - $t) * 1000, 2);
+
+    apc_store(self::WARM_KEY, time());
+    ls('Warmup completed in %.2fms', $stats['ms']);
+    return $stats;
+  }
+
+  // Every controller ApiRunner can dispatch to, including the mutators.
+  protected static function controllers(): int {
+    $count = 0;
+    foreach (ApiRunner::getMap() as $route) {
+      foreach (['', 'Post', 'Put', 'Delete'] as $method) {
+        $path = 'controllers/' . $route['controller'] . $method . '.hh';
+        if (file_exists($path)) {
+          require_once $path;
+          $count++;
+        }
+      }
+    }
+    return $count;
+  }
+
+  protected static function classes(): int {
+    $files = array_unique(Base::classmap());
+    foreach ($files as $path) {
+      require_once $path;
+    }
+    return count($files);
+  }
+
+  protected static function connections(): array<string> {
+    $connections = [];
+    if (BaseConfig::url('MONGOHQ_URL') !== null) {
+      MongoInstance::get();
+      $connections[] = 'mongo';
+    }
+
+    if (BaseConfig::url('REDISCLOUD_URL') !== null) {
+      RedisInstance::get()->ping();
+      $connections[] = 'redis';
+    }
+    return $connections;
+  }
+
+  protected static function bundles(): int {
+    return count(idx(BaseLayoutHelper::manifest(), 'bundles', []));
+  }
+}
@@ -1,22 +1,226 @@
 <?hh
+// Queue entries are either legacy JSON documents (they always start with
+// '{') or binary frames: a magic byte, the codec version and a flags byte,
+// followed by the codec's body. Consumers can always decode whatever an
+// older or newer producer wrote, as long as the codec is registered.
+abstract class BaseWorkerPayloadCodec {
+  abstract public function version(): int;
+  abstract public function encode(array<string, mixed> $entry): string;
+  abstract public function decode(string $body): array<string, mixed>;
+}
+
+class BaseWorkerJSONCodec extends BaseWorkerPayloadCodec {
+  public function version(): int {
+    return 0;
+  }
+
+  public function encode(array<string, mixed> $entry): string {
+    return json_encode($entry);
+  }
+
+  public function decode(string $body): array<string, mixed> {
+    $entry = json_decode($body, true);
+    invariant(
+      json_last_error() == JSON_ERROR_NONE && is_array($entry),
+      'Invalid JSON worker payload');
+    return $entry;
+  }
+}
+
+// Compact binary frames. Worker class names are interned into integers
+// (see BaseWorkerScheduler::internWorkerClass) and objects are reduced to
+// what json_encode would output: jsonSerialize() or their public
+// properties, so workers see the same payload with either codec.
+class BaseWorkerCompactCodec extends BaseWorkerPayloadCodec {
+  public function version(): int {
+    return 1;
+  }
+
+  public function encode(array<string, mixed> $entry): string {
+    $body = fb_compact_serialize([
+      BaseWorkerScheduler::internWorkerClass($entry['worker']),
+      $entry['env'],
+      self::normalize($entry['payload']),
+    ]);
+    invariant(is_string($body), 'Worker payload cannot be serialized');
+    return $body;
+  }
+
+  public function decode(string $body): array<string, mixed> {
+    $success = false;
+    $frame = fb_unserialize($body, $success);
+    invariant(
+      $success && is_array($frame) && count($frame) == 3,
+      'Invalid compact worker payload');
+
+    return [
+      'env' => $frame[1],
+      'worker' => BaseWorkerScheduler::resolveWorkerClass((int)$frame[0]),
+      'payload' => $frame[2],
+    ];
+  }
+
+  protected static function normalize(mixed $value): mixed {
+    if ($value instanceof JsonSerializable) {
+      return self::normalize($value->jsonSerialize());
+    } elseif (is_object($value)) {
+      return self::normalize(get_object_vars($value));
+    } elseif (is_array($value)) {
+      foreach ($value as &$v) {
+        $v = self::normalize($v);
+      }
+    }
+    return $value;
+  }
+}
+
 class BaseWorkerScheduler {
   const string SCHEDULER_KEY = 'workers';
+  const string CLASS_IDS_KEY = 'workers:class_ids';
+  const string CLASS_NAMES_KEY = 'workers:class_names';
+  const string CLASS_SEQUENCE_KEY = 'workers:class_seq';
+  const int CLASS_ID_TTL = 3600;
+
+  const string FRAME_MAGIC = "\xB5";
+  const int FLAG_COMPRESSED = 1;
+
   protected static $queue;
-  protected static function initQueue(): void {
-    invariant(
-      idx($_ENV, 'REDISCLOUD_URL'),
-      'Please specify an instance of Redis');
+  protected static array<string> $envKeys = ['APPLICATION_ENV', 'SERVER_NAME'];
+  protected static array<int, BaseWorkerPayloadCodec> $codecs = [];
+  protected static array<string, int> $classIds = [];
+  protected static array<int, string> $classNames = [];
 
-    self::$queue = new Predis\Client([
-      'host' => parse_url($_ENV['REDISCLOUD_URL'], PHP_URL_HOST),
-      'port' => parse_url($_ENV['REDISCLOUD_URL'], PHP_URL_PORT),
-      'password' => parse_url($_ENV['REDISCLOUD_URL'], PHP_URL_PASS)]);
+  protected static function initQueue(): void {
+    self::$queue = RedisInstance::get();
   }
 
-  public static function run(BaseWorker $worker): void {
+  protected static function queue() {
     if (!self::$queue) {
       self::initQueue();
     }
+    return self::$queue;
+  }
+
+  public static function registerCodec(BaseWorkerPayloadCodec $codec): void {
+    self::$codecs[$codec->version()] = $codec;
+  }
+
+  protected static function codec(int $version): BaseWorkerPayloadCodec {
+    if (!self::$codecs) {
+      self::registerCodec(new BaseWorkerJSONCodec());
+      self::registerCodec(new BaseWorkerCompactCodec());
+    }
+
+    invariant(
+      idx(self::$codecs, $version) !== null,
+      'Unknown worker payload version: %d', $version);
+    return self::$codecs[$version];
+  }
+
+  // Producers keep writing legacy JSON until WORKER_PAYLOAD_VERSION is
+  // raised, so that consumers can be rolled out first.
+  public static function encode(array<string, mixed> $entry): string {
+    $version = BaseConfig::getInt('WORKER_PAYLOAD_VERSION');
+    $body = self::codec($version)->encode($entry);
+    if ($version === 0) {
+      return $body;
+    }
+
+    $flags = 0;
+    $threshold = BaseConfig::getInt(
+      'WORKER_PAYLOAD_COMPRESSION_THRESHOLD',
+      1024);
+    if ($threshold > 0 && strlen($body) >= $threshold) {
+      $compressed = gzcompress(
+        $body,
+        BaseConfig::getInt('WORKER_PAYLOAD_COMPRESSION_LEVEL', 6));
+      if ($compressed !== false && strlen($compressed) < strlen($body)) {
+        $body = $compressed;
+        $flags |= self::FLAG_COMPRESSED;
+      }
+    }
+
+    return self::FRAME_MAGIC . chr($version) . chr($flags) . $body;
+  }
+
+  public static function decode(string $data): array<string, mixed> {
+    if ($data === '' || $data[0] !== self::FRAME_MAGIC) {
+      return self::codec(0)->decode($data);
+    }
+
+    invariant(strlen($data) > 3, 'Truncated worker payload');
+    $version = ord($data[1]);
+    $flags = ord($data[2]);
+    $body = substr($data, 3);
+
+    if ($flags & self::FLAG_COMPRESSED) {
+      $body = gzuncompress($body);
+      invariant($body !== false, 'Corrupted worker payload');
+    }
+
+    return self::codec($version)->decode($body);
+  }
+
+  // Worker class names are stored once in Redis and referenced by id.
+  // The name is published before the id is claimed, so any id a consumer
+  // can see in the queue always resolves. Producers keep the ids in APC
+  // for CLASS_ID_TTL, so that requests do not each look them up.
+  public static function internWorkerClass(string $class): int {
+    if (idx(self::$classIds, $class) !== null) {
+      return self::$classIds[$class];
+    }
+
+    $apc_key = 'base:worker_class:' . $class;
+    $id = apc_fetch($apc_key);
+    if ($id === false) {
+      $queue = self::queue();
+      $id = $queue->hget(self::CLASS_IDS_KEY, $class);
+      if ($id === null) {
+        $id = $queue->incr(self::CLASS_SEQUENCE_KEY);
+        $queue->hset(self::CLASS_NAMES_KEY, $id, $class);
+        if (!$queue->hsetnx(self::CLASS_IDS_KEY, $class, $id)) {
+          $id = $queue->hget(self::CLASS_IDS_KEY, $class);
+        }
+      }
+      apc_store($apc_key, (int)$id, self::CLASS_ID_TTL);
+    }
+
+    self::$classIds[$class] = (int)$id;
+    self::$classNames[(int)$id] = $class;
+    return (int)$id;
+  }
+
+  public static function resolveWorkerClass(int $id): string {
+    if (idx(self::$classNames, $id) !== null) {
+      return self::$classNames[$id];
+    }
+
+    $class = self::queue()->hget(self::CLASS_NAMES_KEY, $id);
+    invariant($class !== null, 'Unknown worker class id: %d', $id);
+
+    self::$classNames[$id] = $class;
+    self::$classIds[$class] = $id;
+    return $class;
+  }
+
+  // Config keys copied into each queued entry. Workers resolve the rest
+  // of their BaseConfig themselves.
+  public static function shareEnv(string $key): void {
+    self::$envKeys[] = $key;
+  }
+
+  protected static function env(): array<string, mixed> {
+    $env = [];
+    foreach (self::$envKeys as $key) {
+      if (BaseConfig::has($key)) {
+        $env[$key] = BaseConfig::get($key);
+      }
+    }
+    return $env;
+  }
+
+  public static function run(BaseWorker $worker): void {
+    $queue = self::queue();
 
     try {
       $worker->beforeRun();
@@ -29,11 +233,11 @@ class BaseWorkerScheduler {
     }
 
     $payload = [
-      'env' => EnvProvider::getAll(),
+      'env' => self::env(),
       'worker' => get_class($worker),
       'payload' => $worker->payload(),
     ];
-    self::$queue->rpush(self::SCHEDULER_KEY, json_encode($payload));
+    $queue->rpush(self::SCHEDULER_KEY, self::encode($payload));
   }
 }
 
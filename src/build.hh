@@ -0,0 +1,5 @@
+<?hh
+require_once __DIR__ . '/init.hh';
+require_once __DIR__ . '/BaseBuild.hh';
+
+exit(BaseBuild::run(array_slice($argv, 1)));
@@ -1,42 +1,92 @@
 <?hh
 function l(...) {
-  $args = func_get_args();
+  if (!BaseLogger::enabled(BaseLogger::INFO)) {
+    return;
+  }
+  log_args(BaseLogger::INFO, func_get_args());
+}
+
+function ld(...) {
+  if (!BaseLogger::enabled(BaseLogger::DEBUG)) {
+    return;
+  }
+  log_args(BaseLogger::DEBUG, func_get_args());
+}
+
+// In JSON mode non-scalar arguments are logged as structured fields
+// instead of their var_dump output.
+function log_args(int $level, array $args) {
   $output = array();
-  ob_start();
+  $fields = array();
+  $json = BaseLogger::isJSON();
   foreach ($args as $arg) {
-    if (!(is_string($arg) || is_numeric($arg))) {
-      var_dump($arg);
-      $output[] = ob_get_contents();
-    } else {
+    if (is_string($arg) || is_numeric($arg)) {
       $output[] = $arg;
+    } elseif ($json) {
+      $fields[] = $arg instanceof Exception ?
+        [
+          'exception' => get_class($arg),
+          'message' => $arg->getMessage(),
+          'file' => $arg->getFile(),
+          'line' => $arg->getLine(),
+        ] :
+        $arg;
+    } else {
+      ob_start();
+      var_dump($arg);
+      $output[] = ob_get_clean();
     }
   }
-  ob_end_clean();
   $message = implode(' ', $output) . PHP_EOL;
-  $backtrace = debug_backtrace(DEBUG_BACKTRACE_IGNORE_ARGS);
-  $backtrace = array_shift($backtrace);
 
-  logger($message, $backtrace['file'], $backtrace['line']);
+  $file = null;
+  $line = null;
+  if (BaseLogger::captureBacktrace()) {
+    // Frame 0 is the call to log_args(), frame 1 the call to l() or ld().
+    $backtrace = debug_backtrace(DEBUG_BACKTRACE_IGNORE_ARGS, 2);
+    $file = $backtrace[1]['file'];
+    $line = $backtrace[1]['line'];
+  }
+
+  logger($message, $file, $line, $level, $fields);
 }
 
 function ls(...) {
+  if (!BaseLogger::enabled(BaseLogger::INFO)) {
+    return;
+  }
   $args = func_get_args();
   $message = call_user_func_array('sprintf', $args);
-  $backtrace = debug_backtrace(DEBUG_BACKTRACE_IGNORE_ARGS);
-  $backtrace = array_shift($backtrace);
 
-  logger($message, $backtrace['file'], $backtrace['line']);
+  $file = null;
+  $line = null;
+  if (BaseLogger::captureBacktrace()) {
+    $backtrace = debug_backtrace(DEBUG_BACKTRACE_IGNORE_ARGS, 1);
+    $backtrace = array_shift($backtrace);
+    $file = $backtrace['file'];
+    $line = $backtrace['line'];
+  }
+
+  logger($message, $file, $line);
 }
 
-function logger($message, $file = null, $line = null) {
-  $resource = fopen($_ENV['BASE_LOG_FILE'], 'a+w');
-  $log = sprintf('[%s:%d] %s',
-    $file, $line, $message);
+// Sampling is done by l(), ld() and ls() before they build the message;
+// logger() only applies the level threshold.
+function logger(
+  $message,
+  $file = null,
+  $line = null,
+  int $level = BaseLogger::INFO,
+  array $fields = []) {
+  if (!BaseLogger::meetsLevel($level)) {
+    return;
+  }
+  $log = BaseLogger::format($level, (string)$message, $file, $line, $fields);
 
-  fwrite($resource, $log);
-  if (idx($_ENV, 'APPLICATION_ENV') !== 'prod' &&
-    idx($_ENV, 'CHROME_LOGGING_ENABLED') &&
-    idx($_ENV, 'WORKER_SCRIPT') == false) {
+  BaseLogger::write($log);
+  if (BaseConfig::get('APPLICATION_ENV') !== 'prod' &&
+    BaseConfig::getBool('CHROME_LOGGING_ENABLED') &&
+    !BaseConfig::getBool('WORKER_SCRIPT')) {
     ChromePhp::log($log);
   }
 }
@@ -69,7 +119,8 @@ function fatal_log() {
   }
 
   $message = sprintf('%s: %s', $error_type, $errstr);
-  logger($message, $errfile, $errline);
+  logger($message, $errfile, $errline, BaseLogger::ERROR);
+  BaseLogger::flush();
 }
 
 function idx($array, $key, $default = null) {